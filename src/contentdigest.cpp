@@ -0,0 +1,220 @@
+#include "contentdigest.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <openssl/sha.h>
+
+static ContentDigest::Digest chunkDigest(const uint8_t* data, uint32_t size)
+{
+    ContentDigest::Digest digest;
+    const uint8_t head[5] = {0xa5, (uint8_t)size, (uint8_t)(size >> 8),
+                             (uint8_t)(size >> 16), (uint8_t)(size >> 24)};
+    SHA256_CTX context;
+    SHA256_Init(&context);
+    SHA256_Update(&context, head, sizeof(head));
+    SHA256_Update(&context, data, size);
+    SHA256_Final(digest.data(), &context);
+    return digest;
+}
+
+ContentDigest::ContentDigest(const std::string& fileName, int threadCount)
+    : f{fileName, File::READ}, start(Clock::now())
+{
+#ifdef _WIN32
+    // Reads go through the shared FILE position
+    threadCount = 1;
+#endif
+    for (int i = 0; i < std::max(threadCount, 1); i++)
+        threads.emplace_back([this] { run(); });
+}
+
+ContentDigest::~ContentDigest()
+{
+    {
+        std::lock_guard lock{m};
+        quit = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+void ContentDigest::setMark(uint64_t offset)
+{
+    {
+        std::lock_guard lock{m};
+        if (offset <= mark)
+            return;
+        mark = offset;
+    }
+    cv.notify_all();
+}
+
+void ContentDigest::add(size_t index, const Digest& digest, uint64_t size,
+                        double seconds)
+{
+    if (chunks.size() <= index)
+        chunks.resize(index + 1);
+    chunks[index] = digest;
+    counters.bytes += size;
+    counters.chunks++;
+    counters.busy += seconds;
+}
+
+void ContentDigest::run()
+{
+    auto buffer = std::make_unique<uint8_t[]>(CHUNK_SIZE);
+    std::unique_lock lock{m};
+    while (!quit && !failed) {
+        const uint64_t offset = nextChunk * CHUNK_SIZE;
+        uint64_t size = CHUNK_SIZE;
+        if (finishing) {
+            if (offset >= end)
+                break;
+            size = std::min(CHUNK_SIZE, end - offset);
+        } else if (offset + CHUNK_SIZE > mark) {
+            cv.wait(lock);
+            continue;
+        }
+        const size_t index = nextChunk++;
+        counters.early += !finishing;
+        lock.unlock();
+
+        auto const t0 = Clock::now();
+        FileMap chunk{f, offset, size, false, buffer.get()};
+        Digest digest;
+        if (chunk.data())
+            digest = chunkDigest(chunk.data(), size);
+        const std::chrono::duration<double> seconds = Clock::now() - t0;
+
+        lock.lock();
+        if (!chunk.data())
+            failed = true;
+        else
+            add(index, digest, size, seconds.count());
+    }
+}
+
+ContentDigest::Digest ContentDigest::finish(uint64_t entriesEnd,
+                                            const std::vector<uint8_t>& cd,
+                                            const std::vector<uint8_t>& eocd)
+{
+    {
+        std::lock_guard lock{m};
+        end = entriesEnd;
+        mark = std::max(mark, entriesEnd);
+        finishing = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+    if (failed)
+        throw io_exception("Could not read back archive for digest");
+
+    for (auto const* section : {&cd, &eocd}) {
+        for (size_t offset = 0; offset < section->size();
+             offset += CHUNK_SIZE) {
+            auto const t0 = Clock::now();
+            const size_t size =
+                std::min<size_t>(CHUNK_SIZE, section->size() - offset);
+            const auto digest = chunkDigest(section->data() + offset, size);
+            const std::chrono::duration<double> seconds = Clock::now() - t0;
+            add(chunks.size(), digest, size, seconds.count());
+        }
+    }
+
+    const uint32_t count = chunks.size();
+    const uint8_t head[5] = {0x5a, (uint8_t)count, (uint8_t)(count >> 8),
+                             (uint8_t)(count >> 16), (uint8_t)(count >> 24)};
+    Digest digest;
+    SHA256_CTX context;
+    SHA256_Init(&context);
+    SHA256_Update(&context, head, sizeof(head));
+    for (auto const& chunk : chunks)
+        SHA256_Update(&context, chunk.data(), chunk.size());
+    SHA256_Final(digest.data(), &context);
+
+    const std::chrono::duration<double> elapsed = Clock::now() - start;
+    counters.elapsed = elapsed.count();
+    return digest;
+}
+
+ContentDigest::Stats ContentDigest::stats()
+{
+    std::lock_guard lock{m};
+    return counters;
+}
+
+static std::vector<uint8_t> readRange(File& f, uint64_t offset, uint64_t size)
+{
+    FileMap map{f, offset, size};
+    if (!map.data())
+        throw io_exception("Could not read archive");
+    return {map.data(), map.data() + size};
+}
+
+ContentDigest::Digest ContentDigest::ofArchive(
+    const std::string& zipName, int threadCount,
+    std::vector<uint8_t>* signingBlock, Stats* stats)
+{
+    const uint32_t EOCD_SIG = 0x06054b50;
+    const char MAGIC[] = "APK Sig Block 42";
+
+    File f{zipName};
+    if (!f.isOpen())
+        throw io_exception("Could not open " + zipName);
+    f.seek(0, File::End);
+    const uint64_t fileSize = f.tell();
+
+    // The end record is 22 bytes plus a comment of up to 64KB
+    const uint64_t tailSize = std::min<uint64_t>(fileSize, 22 + 0xffff);
+    const auto tail = readRange(f, fileSize - tailSize, tailSize);
+    int64_t pos = (int64_t)tailSize - 22;
+    for (; pos >= 0; pos--) {
+        uint32_t sig;
+        memcpy(&sig, &tail[pos], 4);
+        if (sig == EOCD_SIG)
+            break;
+    }
+    if (pos < 0)
+        throw io_exception("Not a zip archive: " + zipName);
+    const uint64_t eocdOffset = fileSize - tailSize + pos;
+
+    uint32_t sizeCD;
+    uint32_t startCD;
+    memcpy(&sizeCD, tail.data() + pos + 12, 4);
+    memcpy(&startCD, tail.data() + pos + 16, 4);
+    if (startCD == 0xffffffff)
+        throw io_exception("Zip64 archives have no content digest");
+    if ((uint64_t)startCD + sizeCD > eocdOffset)
+        throw io_exception("Bad central directory in " + zipName);
+
+    uint64_t entriesEnd = startCD;
+    if (startCD >= 32) {
+        const auto footer = readRange(f, startCD - 24, 24);
+        if (memcmp(&footer[8], MAGIC, 16) == 0) {
+            uint64_t blockSize;
+            memcpy(&blockSize, &footer[0], 8);
+            if (blockSize + 8 > startCD)
+                throw io_exception("Bad APK Signing Block in " + zipName);
+            entriesEnd = startCD - blockSize - 8;
+            if (signingBlock)
+                *signingBlock = readRange(f, entriesEnd, blockSize + 8);
+        }
+    }
+
+    // Everything from the central directory up to the end record counts as
+    // central directory, and the end record points where the block starts
+    const auto cd = readRange(f, startCD, eocdOffset - startCD);
+    std::vector<uint8_t> eocd(tail.begin() + pos, tail.end());
+    const uint32_t offset = entriesEnd;
+    memcpy(eocd.data() + 16, &offset, 4);
+
+    ContentDigest digest{zipName, threadCount};
+    const auto result = digest.finish(entriesEnd, cd, eocd);
+    if (stats)
+        *stats = digest.stats();
+    return result;
+}
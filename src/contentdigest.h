@@ -0,0 +1,81 @@
+#pragma once
+
+#include "file.h"
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The content digest of APK Signature Scheme v2/v3: SHA-256 over 1MB chunks
+// of the zip entries, the central directory and the end of central directory
+// record, with the chunk digests hashed together at the end.
+//
+// The entries are read back from the archive file by a pool of threads while
+// it is still being written, up to the point that is known to be final (see
+// setMark()). Chunks are hashed in any order.
+class ContentDigest
+{
+public:
+    static constexpr uint64_t CHUNK_SIZE = 1024 * 1024;
+    using Digest = std::array<uint8_t, 32>;
+
+    struct Stats
+    {
+        uint64_t bytes = 0;
+        int chunks = 0;
+        // Chunks hashed before finish() was called
+        int early = 0;
+        // Seconds spent hashing, summed over all threads
+        double busy = 0;
+        // Seconds from construction until finish() returned
+        double elapsed = 0;
+    };
+
+    explicit ContentDigest(const std::string& fileName, int threadCount = 1);
+    ~ContentDigest();
+
+    // Nothing before 'offset' in the file will be written again
+    void setMark(uint64_t offset);
+
+    // The entries end at 'entriesEnd'. 'eocd' must have its central
+    // directory offset set to 'entriesEnd', which is where the signing block
+    // goes.
+    Digest finish(uint64_t entriesEnd, const std::vector<uint8_t>& cd,
+                  const std::vector<uint8_t>& eocd);
+
+    Stats stats();
+
+    // Digest of an existing archive. An APK Signing Block in front of the
+    // central directory is skipped, and returned in 'signingBlock' if
+    // given.
+    static Digest ofArchive(const std::string& zipName, int threadCount,
+                            std::vector<uint8_t>* signingBlock = nullptr,
+                            Stats* stats = nullptr);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void run();
+    void add(size_t index, const Digest& digest, uint64_t size,
+             double seconds);
+
+    File f;
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable cv;
+    uint64_t mark = 0;
+    // Set by finish(); the last chunk before it may be partial
+    uint64_t end = 0;
+    bool finishing = false;
+    bool quit = false;
+    bool failed = false;
+    size_t nextChunk = 0;
+    std::vector<Digest> chunks;
+    Stats counters;
+    Clock::time_point start;
+};
@@ -416,10 +416,235 @@ uint32_t crc32_16bytes_prefetch(const void* data, size_t length, uint32_t previo
 }
 
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32_PCLMUL
+#ifdef _MSC_VER
+  #include <intrin.h>
+  #define PCLMUL_TARGET
+#else
+  #include <cpuid.h>
+  #define PCLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#include <immintrin.h>
+
+/// true if the CPU has PCLMULQDQ and SSE4.1
+static bool has_pclmul()
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  uint32_t ecx = info[2];
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+#endif
+  return (ecx & (1 << 1)) && (ecx & (1 << 19));
+}
+
+
+/// compute CRC32 by folding 64 bytes at a time with carry-less multiplies
+/// (Intel's "Fast CRC Computation Using PCLMULQDQ"), length must be a multiple
+/// of 16 and at least 64. Works on the raw (not inverted) CRC.
+PCLMUL_TARGET static uint32_t crc32_pclmul_fold(const uint8_t* data, size_t length, uint32_t crc)
+{
+  // bit-reflected constants x^(4*128+32) mod P, x^(4*128-32) mod P, etc
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  data   += 64;
+  length -= 64;
+
+  // fold four 128 bit lanes in parallel
+  while (length >= 64)
+  {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+    data   += 64;
+    length -= 64;
+  }
+
+  // fold the four lanes into one
+  __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // remaining 16 byte blocks
+  while (length >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    data   += 16;
+    length -= 16;
+  }
+
+  // 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_and_si128(x1, mask);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+
+/// compute CRC32 (PCLMULQDQ folding for the bulk, Slicing-by-16 for the tail)
+uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32 = 0)
+{
+  if (length < 64)
+    return crc32_16bytes(data, length, previousCrc32);
+
+  const size_t bulk = length & ~(size_t)15;
+  uint32_t crc = ~crc32_pclmul_fold((const uint8_t*)data, bulk, ~previousCrc32);
+  return crc32_16bytes((const uint8_t*)data + bulk, length - bulk, crc);
+}
+#endif
+
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <string.h>
+
+/// compute CRC32 (ARMv8 CRC32 instructions)
+uint32_t crc32_armv8(const void* data, size_t length, uint32_t previousCrc32 = 0)
+{
+  uint32_t crc = ~previousCrc32;
+  const uint8_t* current = (const uint8_t*) data;
+
+  while (length >= 8)
+  {
+    uint64_t value;
+    memcpy(&value, current, 8);
+    crc = __crc32d(crc, value);
+    current += 8;
+    length  -= 8;
+  }
+  while (length-- != 0)
+    crc = __crc32b(crc, *current++);
+
+  return ~crc;
+}
+#endif
+
+
 /// compute CRC32 using the fastest algorithm for large datasets on modern CPUs
+/// (hardware support is detected on first use)
 uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32 = 0)
 {
+#if defined(CRC32_ARMV8)
+  return crc32_armv8(data, length, previousCrc32);
+#else
+#if defined(CRC32_PCLMUL)
+  static const bool pclmul = has_pclmul();
+  if (pclmul)
+    return crc32_pclmul(data, length, previousCrc32);
+#endif
   return crc32_16bytes(data, length, previousCrc32);
+#endif
+}
+
+
+/// multiply two polynomials modulo the CRC32 polynomial (both bit-reflected,
+/// so x^0 is the highest bit)
+static uint32_t multiply_modp(uint32_t a, uint32_t b)
+{
+  uint32_t product = 0;
+  for (uint32_t mask = (uint32_t)1 << 31; mask != 0; mask >>= 1)
+  {
+    if (a & mask)
+    {
+      product ^= b;
+      if ((a & (mask - 1)) == 0)
+        break;
+    }
+    b = (b & 1) ? (b >> 1) ^ Polynomial : b >> 1;
+  }
+  return product;
+}
+
+
+/// x^(2^n) mod P for n = 0..31, computed once. x has order 2^32-1 modulo the
+/// CRC32 polynomial, so x^(2^(n+32)) = x^(2^n) and 32 entries cover all n.
+static const uint32_t* power_table()
+{
+  static const struct PowerTable
+  {
+    uint32_t power[32];
+    PowerTable()
+    {
+      uint32_t p = (uint32_t)1 << 30; // x^1
+      for (int n = 0; n < 32; n++)
+      {
+        power[n] = p;
+        p = multiply_modp(p, p);
+      }
+    }
+  } table;
+  return table.power;
+}
+
+
+/// operator that appends lengthB zero bytes to a CRC, i.e. x^(8*lengthB) mod P,
+/// for use with crc32_combine_op when combining many blocks of the same size
+uint32_t crc32_combine_gen(size_t lengthB)
+{
+  const uint32_t* power = power_table();
+  uint32_t op = (uint32_t)1 << 31; // x^0
+  // 8 * lengthB bits, so start at x^(2^3)
+  for (int n = 3; lengthB != 0; n++, lengthB >>= 1)
+    if (lengthB & 1)
+      op = multiply_modp(power[n & 31], op);
+  return op;
+}
+
+
+/// combine two CRC32s with an operator from crc32_combine_gen(lengthB)
+uint32_t crc32_combine_op(uint32_t crcA, uint32_t crcB, uint32_t op)
+{
+  return multiply_modp(op, crcA) ^ crcB;
+}
+
+
+/// combine two CRC32s, crcA of block A and crcB of block B (lengthB bytes),
+/// to the CRC32 of A followed by B (same as zlib's crc32_combine)
+uint32_t crc32_combine(uint32_t crcA, uint32_t crcB, size_t lengthB)
+{
+  return crc32_combine_op(crcA, crcB, crc32_combine_gen(lengthB));
 }
 
 
@@ -23,6 +23,8 @@ private:
 
 std::string base64_encode(unsigned char const* bytes_to_encode,
                           unsigned int in_len);
+// Empty if 'text' is not valid base64
+std::vector<uint8_t> base64_decode(const std::string& text);
 
 std::string toPem(std::vector<uint8_t> key);
 std::vector<uint8_t> recoverKey(const std::string& password,
@@ -9,17 +9,23 @@
 #include "sign.h"
 #include "utils.h"
 #include "ziparchive.h"
+#include "zipcache.h"
 #include "zipformat.h"
 #include "zipstream.h"
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 
 #include <cstdio>
 #include <deque>
+#include <memory>
+#include <numeric>
 #include <string>
 #include <vector>
 
@@ -31,9 +37,18 @@ using std::vector;
 static constexpr int SHA_LEN = 20;
 
 int64_t iz_deflate(int level, char* tgt, char* src, unsigned long tgtsize,
-                   unsigned long srcsize);
+                   unsigned long srcsize, char* dict = nullptr,
+                   unsigned dictsize = 0, bool syncflush = false,
+                   void (*scan)(void*, const char*, unsigned) = nullptr,
+                   void* scanHandle = nullptr);
 uint32_t crc32_fast(const void* data, size_t length,
                     uint32_t previousCrc32 = 0);
+uint32_t crc32_combine(uint32_t crcA, uint32_t crcB, size_t lengthB);
+int64_t iz_deflate_stream(int level,
+                          unsigned (*reader)(void*, char*, unsigned),
+                          void* readHandle,
+                          void (*writer)(void*, char*, unsigned),
+                          void* writeHandle, char* buf, unsigned long bufsize);
 
 static int store_compressed(File& f, int inSize, uint8_t* target, uint8_t* sha)
 {
@@ -71,6 +86,22 @@ static int store_compressed(File& f, int inSize, uint8_t* target, uint8_t* sha)
     return total;
 }
 
+// Checksums updated with each block the deflater reads, so the input only
+// has to be brought into cache once
+struct InputScan
+{
+    uint32_t crc = 0;
+    SHA_CTX* sha = nullptr;
+};
+
+static void scan_block(void* handle, const char* data, unsigned size)
+{
+    auto* scan = static_cast<InputScan*>(handle);
+    scan->crc = crc32_fast(data, size, scan->crc);
+    if (scan->sha)
+        SHA1_Update(scan->sha, data, size);
+}
+
 enum class PackResult
 {
     FAILED = -1,
@@ -178,32 +209,89 @@ static PackResult intel_deflate(File& f, size_t inSize, uint8_t* buffer,
 
 #endif
 
+static constexpr int CACHE_ENGINE_INFOZIP = 1;
+
 static PackResult infozip_deflate(int packLevel, File& f, int inSize,
                                   uint8_t* buffer, size_t* outSize,
-                                  uint32_t* checksum, uint8_t* sha)
+                                  uint32_t* checksum, uint8_t* sha,
+                                  bool mapInput, bool populate,
+                                  CompressCache* cache)
 {
-    uint8_t* fileData = buffer + *outSize - inSize;
-    if ((int)f.Read(fileData, inSize) != inSize)
+    // Input goes at the end of the output buffer, unless we can map it
+    uint8_t* readBuf = buffer + *outSize - inSize;
+    const uint8_t* fileData = readBuf;
+    std::unique_ptr<FileMap> input;
+    CompressCache::Hasher hasher;
+    if (mapInput) {
+        input = std::make_unique<FileMap>(f, f.tell(), inSize, populate,
+                                          readBuf);
+        fileData = input->data();
+        if (!fileData)
+            return PackResult::FAILED;
+        if (cache)
+            hasher.update(fileData, inSize);
+    } else if (cache) {
+        // Hash each piece while it is still in cache
+        const int CHUNK = 256 * 1024;
+        for (int pos = 0; pos < inSize; pos += CHUNK) {
+            const int size = std::min(CHUNK, inSize - pos);
+            if ((int)f.Read(readBuf + pos, size) != size)
+                return PackResult::FAILED;
+            hasher.update(readBuf + pos, size);
+        }
+    } else if ((int)f.Read(readBuf, inSize) != inSize)
         return PackResult::FAILED;
 
-    if (sha) {
-        SHA_CTX context;
-        SHA1_Init(&context);
-        SHA1_Update(&context, fileData, inSize);
-        SHA1_Final(sha, &context);
+    CompressCache::Key key;
+    CompressCache::Entry cached;
+    if (cache) {
+        // The input is not needed after a hit; stored entries have no data
+        key = hasher.finish(inSize, packLevel, CACHE_ENGINE_INFOZIP);
+        if (cache->get(key, cached, buffer, *outSize)) {
+            if (sha)
+                memcpy(sha, cached.sha, SHA_LEN);
+            if (checksum)
+                *checksum = cached.crc;
+            if (cached.stored) {
+                memmove(buffer, fileData, inSize);
+                *outSize = (size_t)inSize << 3;
+                return PackResult::STORED;
+            }
+            *outSize = cached.dataSize << 3;
+            return PackResult::COMPRESSED;
+        }
     }
 
-    if (checksum) {
-        *checksum = crc32_fast(fileData, inSize);
+    // Cached entries always carry the SHA1, so later signed builds can hit
+    SHA_CTX context;
+    InputScan scan;
+    if (sha || cache) {
+        SHA1_Init(&context);
+        scan.sha = &context;
     }
 
     int64_t compSize =
-        iz_deflate(packLevel, (char*)buffer, (char*)fileData, *outSize, inSize);
+        iz_deflate(packLevel, (char*)buffer, (char*)fileData, *outSize, inSize,
+                   nullptr, 0, false, scan_block, &scan);
     if (compSize == -1)
         return PackResult::FAILED;
 
+    if (scan.sha)
+        SHA1_Final(cached.sha, &context);
+    if (sha)
+        memcpy(sha, cached.sha, SHA_LEN);
+    if (checksum)
+        *checksum = scan.crc;
+
+    if (cache) {
+        cached.stored = compSize == -2;
+        cached.crc = scan.crc;
+        cached.dataSize = cached.stored ? 0 : (compSize + 7) >> 3;
+        cache->put(key, cached, buffer);
+    }
+
     if (compSize == -2) {
-        *outSize = inSize << 3;
+        *outSize = (size_t)inSize << 3;
         // memmove(buffer, fileData, inSize);
         return PackResult::STORED;
     }
@@ -213,6 +301,136 @@ static PackResult infozip_deflate(int packLevel, File& f, int inSize,
     return PackResult::COMPRESSED;
 }
 
+// A large file being deflated in independent chunks by several workers.
+// Every chunk but the last ends with a sync flush, and every chunk but the
+// first is primed with the 32KB preceding it, so the chunks can be joined
+// into one deflate stream. With 'indexed', chunks get no dictionary so
+// inflating can start at any of them.
+struct SplitJob
+{
+    struct Chunk
+    {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size = 0;
+        uint32_t crc = 0;
+        bool failed = false;
+    };
+
+    fs::path source;
+    uint64_t size = 0;
+    uint64_t chunkSize = 0;
+    int level = 0;
+    bool mapInput = false;
+    bool populate = false;
+    bool indexed = false;
+    std::vector<Chunk> chunks;
+    // Protected by the worker mutex
+    int nextChunk = 0;
+    int doneChunks = 0;
+};
+
+static constexpr uint64_t DICT_SIZE = 32 * 1024;
+
+static void deflate_chunk(SplitJob& job, int i)
+{
+    auto& chunk = job.chunks[i];
+    const uint64_t start = i * job.chunkSize;
+    const size_t inSize = std::min(job.chunkSize, job.size - start);
+    const size_t dictSize = job.indexed ? 0 : std::min(start, DICT_SIZE);
+    const bool last = (i == (int)job.chunks.size() - 1);
+
+    // Same layout as packZipData; dictionary and input at the end of the
+    // output buffer
+    size_t outSize = inSize + (inSize / 16383 + 1) * 5 + 64 * 1024 + dictSize;
+    auto buffer = std::make_unique<uint8_t[]>(outSize);
+    uint8_t* dict = buffer.get() + outSize - inSize - dictSize;
+    uint8_t* fileData = dict + dictSize;
+
+    File f{job.source};
+    std::unique_ptr<FileMap> input;
+    if (job.mapInput) {
+        input = std::make_unique<FileMap>(f, start - dictSize,
+                                          dictSize + inSize, job.populate, dict);
+        if (!input->data()) {
+            chunk.failed = true;
+            return;
+        }
+        dict = const_cast<uint8_t*>(input->data());
+        fileData = dict + dictSize;
+    } else {
+        f.seek(start - dictSize);
+        if (f.Read(dict, dictSize + inSize) != dictSize + inSize) {
+            chunk.failed = true;
+            return;
+        }
+    }
+    InputScan scan;
+    int64_t bits =
+        iz_deflate(job.level, (char*)buffer.get(), (char*)fileData, outSize,
+                   inSize, (char*)dict, dictSize, !last, scan_block, &scan);
+    if (bits < 0) {
+        chunk.failed = true;
+        return;
+    }
+    chunk.crc = scan.crc;
+    chunk.size = (bits + 7) >> 3;
+    chunk.data = std::move(buffer);
+}
+
+// Join the deflated chunks into one entry. Returns false if compression
+// failed or did not pay off, in which case the file should be stored.
+static bool join_chunks(SplitJob& job, ZipEntry& target)
+{
+    uint64_t total = 0;
+    uint32_t crc = 0;
+    for (size_t i = 0; i < job.chunks.size(); i++) {
+        auto const& chunk = job.chunks[i];
+        if (chunk.failed)
+            return false;
+        total += chunk.size;
+        auto const inSize =
+            std::min(job.chunkSize, job.size - i * job.chunkSize);
+        crc = crc32_combine(crc, chunk.crc, inSize);
+    }
+    if (total >= job.size)
+        return false;
+
+    target.data = std::make_unique<uint8_t[]>(total);
+    uint8_t* ptr = target.data.get();
+    std::vector<AccessPoint> points;
+    for (size_t i = 0; i < job.chunks.size(); i++) {
+        auto& chunk = job.chunks[i];
+        if (job.indexed && i > 0)
+            points.push_back({(uint64_t)(ptr - target.data.get()),
+                              i * job.chunkSize});
+        memcpy(ptr, chunk.data.get(), chunk.size);
+        ptr += chunk.size;
+        chunk.data = nullptr;
+    }
+    if (!points.empty()) {
+        // Use every n:th point if they don't all fit in the extra field
+        const size_t maxPoints =
+            (0xffff - 4 - sizeof(Extra64)) / sizeof(AccessPoint);
+        const size_t step = (points.size() + maxPoints - 1) / maxPoints;
+        const uint16_t id = AccessIndex_ID;
+        const uint16_t size =
+            (points.size() + step - 1) / step * sizeof(AccessPoint);
+        target.extra.resize(4);
+        memcpy(&target.extra[0], &id, 2);
+        memcpy(&target.extra[2], &size, 2);
+        for (size_t i = step - 1; i < points.size(); i += step) {
+            auto const* p = reinterpret_cast<const uint8_t*>(&points[i]);
+            target.extra.insert(target.extra.end(), p,
+                                p + sizeof(AccessPoint));
+        }
+    }
+    target.dataSize = total;
+    target.originalSize = job.size;
+    target.crc = crc;
+    target.store = false;
+    return true;
+}
+
 void Fastzip::packZipData(File& f, int size, PackFormat inFormat,
                           PackFormat outFormat, uint8_t* sha, ZipEntry& target)
 {
@@ -236,7 +454,8 @@ void Fastzip::packZipData(File& f, int size, PackFormat inFormat,
 
         if (outFormat >= ZIP1_COMPRESSED && outFormat <= ZIP9_COMPRESSED) {
             state = infozip_deflate(outFormat, f, size, outBuf.get(), &outSize,
-                                    &target.crc, sha);
+                                    &target.crc, sha, mapInput, populateInput,
+                                    cache.get());
             outSize = (outSize + 7) >> 3;
         }
 #ifdef WITH_INTEL
@@ -274,12 +493,243 @@ void Fastzip::packZipData(File& f, int size, PackFormat inFormat,
     target.dataSize = outSize;
 }
 
+struct StreamState
+{
+    File& f;
+    uint64_t left;
+    uint32_t crc;
+    SHA_CTX* sha;
+    ZipArchive& archive;
+    uint64_t written;
+};
+
+static unsigned stream_read(void* handle, char* target, unsigned size)
+{
+    auto* state = static_cast<StreamState*>(handle);
+    if (size > state->left)
+        size = state->left;
+    auto rc = state->f.Read(target, size);
+    state->left -= rc;
+    state->crc = crc32_fast(target, rc, state->crc);
+    if (state->sha)
+        SHA1_Update(state->sha, target, rc);
+    return rc;
+}
+
+static void stream_write(void* handle, char* data, unsigned size)
+{
+    auto* state = static_cast<StreamState*>(handle);
+    state->archive.write((uint8_t*)data, size);
+    state->written += size;
+}
+
+// Compress a file in fixed size windows directly into the archive, so
+// memory use does not depend on file size. Caller must have exclusive
+// access to the archive.
+void Fastzip::packStreamData(File& f, uint64_t size, PackFormat outFormat,
+                             uint8_t* sha, ZipEntry& target,
+                             ZipArchive& zipArchive)
+{
+    const size_t windowSize =
+        std::clamp<uint64_t>(memoryBudget / 4, 64 * 1024, 4 * 1024 * 1024);
+    auto window = std::make_unique<uint8_t[]>(windowSize);
+
+    SHA_CTX context;
+    if (sha)
+        SHA1_Init(&context);
+    StreamState state{f, size, 0, sha ? &context : nullptr, zipArchive, 0};
+
+    target.store =
+        !(outFormat >= ZIP1_COMPRESSED && outFormat <= ZIP9_COMPRESSED);
+    target.originalSize = size;
+    // Worst case size, decides if zip64 headers are needed
+    target.dataSize = size + (size / 16383 + 1) * 5;
+    zipArchive.beginEntry(target);
+
+    if (target.store) {
+        while (auto rc = stream_read(&state, (char*)window.get(), windowSize))
+            stream_write(&state, (char*)window.get(), rc);
+    } else {
+        iz_deflate_stream(outFormat, stream_read, &state, stream_write, &state,
+                          (char*)window.get(), windowSize);
+    }
+    if (state.left > 0)
+        warning(string("Could not read all of ") + target.name);
+
+    if (sha)
+        SHA1_Final(sha, &context);
+    target.crc = state.crc;
+    target.dataSize = state.written;
+    target.originalSize = size - state.left;
+    zipArchive.endEntry(target);
+}
+
 void Fastzip::addZip(const fs::path& zipName, PackFormat format)
 {
-    for (auto const& entry : ZipStream{zipName}) {
-        fileNames.emplace_back(zipName, entry.name, format, entry.offset);
+    // Keep the order files were added in, later entries replace earlier
+    walkDirs(1);
+    ZipStream zs{zipName};
+    for (auto const& entry : zs) {
+        fileNames.emplace_back(zipName, entry.name, format, entry.offset,
+                               entry.uncompSize);
         strLen += entry.name.length();
     }
+    loadDigests(zipName, zs);
+    addedZips.push_back(zipName);
+}
+
+static string digestKey(const fs::path& zipName, const string& name)
+{
+    return zipName.string() + '\0' + name;
+}
+
+void Fastzip::loadDigests(const fs::path& zipName, ZipStream& zs)
+{
+    // Entries are named in the manifest, but the digests are only used if
+    // the entry still matches the central directory
+    const ZipStream::Entry* manifest = nullptr;
+    std::unordered_map<string, const ZipStream::Entry*> byName;
+    for (auto const& entry : zs) {
+        byName[entry.name] = &entry;
+        if (entry.name == "META-INF/MANIFEST.MF")
+            manifest = &entry;
+    }
+
+    string text;
+    if (manifest && (manifest->method == 0 || manifest->method == 8)) {
+        File f = zs.dupFile();
+        f.seek(manifest->offset);
+        auto const le = f.Read<LocalEntry>();
+        f.seek(le.nameLen + le.exLen, File::Seek::Cur);
+        vector<uint8_t> packed(manifest->compSize);
+        text.resize(manifest->uncompSize);
+        if (f.Read(packed.data(), packed.size()) != packed.size())
+            text.clear();
+        else if (manifest->method == 0)
+            text.assign(packed.begin(), packed.end());
+        else {
+            mz_stream stream;
+            memset(&stream, 0, sizeof(stream));
+            mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS);
+            stream.next_in = packed.data();
+            stream.avail_in = packed.size();
+            stream.next_out = (uint8_t*)&text[0];
+            stream.avail_out = text.size();
+            if (mz_inflate(&stream, MZ_FINISH) != MZ_STREAM_END ||
+                stream.avail_out != 0)
+                text.clear();
+            mz_inflateEnd(&stream);
+        }
+    }
+
+    // Lines longer than 72 bytes continue on lines starting with a space
+    string name;
+    string digest;
+    auto const addSection = [&] {
+        auto it = byName.find(name);
+        auto const sha = base64_decode(digest);
+        if (it != byName.end() && sha.size() == SHA_LEN) {
+            auto& known = knownDigests[digestKey(zipName, name)];
+            known.crc = it->second->crc;
+            known.size = it->second->uncompSize;
+            memcpy(known.sha, sha.data(), SHA_LEN);
+        }
+        name.clear();
+        digest.clear();
+    };
+    string* current = nullptr;
+    for (auto const& line : split(text, "\n")) {
+        auto const l = !line.empty() && line.back() == '\r'
+                           ? line.substr(0, line.size() - 1)
+                           : line;
+        if (l.empty()) {
+            addSection();
+            current = nullptr;
+        } else if (l[0] == ' ' && current)
+            *current += l.substr(1);
+        else if (startsWith(l, "Name: "))
+            *(current = &name) = l.substr(6);
+        else if (startsWith(l, "SHA1-Digest: "))
+            *(current = &digest) = l.substr(13);
+        else
+            current = nullptr;
+    }
+    addSection();
+}
+
+void Fastzip::loadDigestIndex(const fs::path& zipName)
+{
+    // One "<crc> <size> <sha1> <name>" line per entry
+    File index;
+    if (index.open((zipName.string() + ".digests").c_str(), File::READ)) {
+        for (auto const& line : index.lines()) {
+            auto const parts = split(line, " ", 3);
+            auto const sha =
+                parts.size() == 4 ? base64_decode(parts[2]) : vector<uint8_t>{};
+            if (sha.size() != SHA_LEN)
+                continue;
+            auto& known = knownDigests[digestKey(zipName, parts[3])];
+            known.crc = strtoul(parts[0].c_str(), nullptr, 16);
+            known.size = strtoull(parts[1].c_str(), nullptr, 10);
+            memcpy(known.sha, sha.data(), SHA_LEN);
+        }
+    }
+}
+
+const Fastzip::KnownDigest* Fastzip::findDigest(const FileTarget& file,
+                                                uint32_t crc, uint64_t size)
+{
+    auto it = knownDigests.find(digestKey(file.source, file.target));
+    if (it == knownDigests.end() || it->second.crc != crc ||
+        it->second.size != size)
+        return nullptr;
+    return &it->second;
+}
+
+void Fastzip::loadBase()
+{
+    ZipStream zs{baseZip.string()};
+    if (!zs.valid()) {
+        warning(string("Could not read base archive ") + baseZip.string());
+        return;
+    }
+    for (auto const& entry : zs) {
+        if (entry.name.empty() || entry.name.back() == '/' ||
+            (entry.method != 0 && entry.method != 8))
+            continue;
+        baseEntries[entry.name] = {(uint64_t)entry.offset, entry.compSize,
+                                   entry.uncompSize,     entry.crc,
+                                   entry.dateTime,       entry.method == 0};
+    }
+}
+
+const Fastzip::BaseEntry* Fastzip::findBase(const FileTarget& file)
+{
+    auto it = baseEntries.find(file.target);
+    if (it == baseEntries.end())
+        return nullptr;
+    auto const& base = it->second;
+    if (base.uncompSize != file.uncompSize)
+        return nullptr;
+    // Deflated data can't be used if the file should be stored now
+    if (!base.stored && file.packFormat == UNCOMPRESSED)
+        return nullptr;
+    if (base.dateTime == unixToMsdosTime(file.mtime))
+        return &base;
+    if (!baseByContent)
+        return nullptr;
+
+    File f{file.source};
+    if (!f.isOpen())
+        return nullptr;
+    uint32_t crc = 0;
+    if (file.uncompSize > 0) {
+        FileMap data{f, 0, file.uncompSize};
+        if (!data.data())
+            return nullptr;
+        crc = crc32_fast(data.data(), file.uncompSize);
+    }
+    return crc == base.crc ? &base : nullptr;
 }
 
 void Fastzip::addDir(const PathAlias& dirName, PackFormat format)
@@ -309,18 +759,33 @@ void Fastzip::addDir(const PathAlias& dirName, PackFormat format)
         skipLen = fn - d.c_str();
     }
 
-    // Recursivly add all files to fileNames
-    listFiles(d, [&](const string& path) {
-        string target = path.substr(skipLen);
-        PackFormat pf = format;
+    // The directory is walked later, possibly while packing has started
+    dirWalks.push_back({d, dirName.aliasTo, skipLen, format, storeExts});
+}
 
-        if (!storeExts.empty()) {
+void Fastzip::walkDir(const DirWalk& walk, int threads,
+                      const std::function<void(FileTarget&&)>& add)
+{
+    ::walkDir(walk.dir.string(), threads,
+              [&](const string& path, const struct stat* st) {
+        // Only regular files (or links to them) are packed
+        if (!st) {
+            warning(string("Could not access ") + path);
+            return;
+        }
+        if ((st->st_mode & S_IFMT) != S_IFREG)
+            return;
+
+        string target = path.substr(walk.skipLen);
+        PackFormat pf = walk.format;
+
+        if (!walk.storeExts.empty()) {
             const char* ext = nullptr;
             auto dot = path.find_last_of('.');
             if (dot != string::npos)
                 ext = &path.c_str()[dot + 1];
             if (ext && *ext) {
-                for (const auto& se : storeExts) {
+                for (const auto& se : walk.storeExts) {
                     if (strcmp(se.c_str(), ext) == 0) {
                         pf = UNCOMPRESSED;
                         break;
@@ -329,18 +794,36 @@ void Fastzip::addDir(const PathAlias& dirName, PackFormat format)
             }
         }
 
-        if (dirName.aliasTo.length()) {
-            target = dirName.aliasTo + target;
+        if (walk.aliasTo.length()) {
+            target = walk.aliasTo + target;
         }
         for (auto& t : target)
             if (t == '\\')
                 t = '/';
-        strLen += target.length();
 
-        fileNames.emplace_back(path, target, pf);
+        FileTarget fileTarget{path, target, pf, 0xffffffff,
+                              (uint64_t)st->st_size};
+        fileTarget.mode = st->st_mode;
+        fileTarget.mtime = st->st_mtime;
+        fileTarget.uid = st->st_uid;
+        fileTarget.gid = st->st_gid;
+        add(std::move(fileTarget));
     });
 }
 
+void Fastzip::walkDirs(int threads)
+{
+    std::mutex m;
+    for (auto const& walk : dirWalks) {
+        walkDir(walk, threads, [&](FileTarget&& target) {
+            std::lock_guard lock{m};
+            strLen += target.target.length();
+            fileNames.emplace_back(std::move(target));
+        });
+    }
+    dirWalks.clear();
+}
+
 void Fastzip::exec()
 {
     using std::condition_variable;
@@ -351,34 +834,288 @@ void Fastzip::exec()
 
     std::error_code ec;
 
-    if (fileNames.empty())
-        throw fastzip_exception("No paths specified");
-    if (fileNames.size() >= 65535)
-        warning("More than 64K files, adding 64bit features.");
+    // A single directory can be walked while packing it. Otherwise walk
+    // everything first so later files replace earlier ones, and only use one
+    // thread if the order matters.
+    const bool streamWalk = dirWalks.size() == 1 && fileNames.empty() &&
+                            schedule == FIFO && !doSeq;
+    if (!streamWalk)
+        walkDirs(doSeq ? 1 : threadCount);
+    fileNames.compact();
     if (zipfile == "")
         throw fastzip_exception("Zipfile must be specified");
+    // Updating without adding anything can still compact the archive
+    const bool updating = update && fs::exists(zipfile);
+    if (fileNames.empty() && !streamWalk && !(updating && compact))
+        throw fastzip_exception("No paths specified");
+    if (updating) {
+        if (doSign || writeDigests)
+            throw fastzip_exception(
+                "Can not sign or write digests while updating a zip");
+        if (!ZipStream{zipfile.string()}.valid())
+            throw fastzip_exception("Can not update, not a zip archive");
+    }
 
     if (doSign) {
         if (!keyStore.load(keystoreName))
             throw fastzip_exception("Could not load keystore");
     }
+    if (!baseZip.empty())
+        loadBase();
+    if (readDigests) {
+        for (auto const& zipName : addedZips)
+            loadDigestIndex(zipName);
+    }
+    std::atomic<int> baseHits{0};
+    std::atomic<int> digestHits{0};
+    // Every entry needs its SHA1 for the manifest or the digest index
+    const bool needSha = doSign || writeDigests;
+    string digestIndex;
+    if (!cacheDir.empty()) {
+        try {
+            cache = std::make_shared<CompressCache>(cacheDir, cacheSize);
+        } catch (io_exception& e) {
+            warning(string(e.what()) + ", not caching");
+        }
+    }
 
-    const fs::path tempFile = fs::path(zipfile.string() + ".fastzip_");
-    fs::remove(tempFile, ec);
+    // A new archive is written next to the target and renamed at the end
+    const fs::path tempFile =
+        updating ? zipfile : fs::path(zipfile.string() + ".fastzip_");
+    if (!updating)
+        fs::remove(tempFile, ec);
     ZipArchive zipArchive(tempFile.c_str(), fileNames.size() + 5,
-                          strLen + 1024);
+                          strLen + 1024,
+                          updating ? ZipArchive::UPDATE : ZipArchive::CREATE);
     zipArchive.doAlign(zipAlign);
     zipArchive.doForce64(force64);
+    zipArchive.doCompact(compact);
+    if (doSign && signScheme >= 2)
+        zipArchive.doDigest(threadCount);
 
-    auto digestFile =
-        std::make_unique<char[]>(strLen + fileNames.size() * 6400);
-    char* digestPtr = digestFile.get();
+    string digestFile;
 
     mutex m;
     condition_variable seq_cv;
     int currentIndex = 0;
     const int totalCount = fileNames.size();
 
+    // Large files currently being split, and the number of workers busy
+    // with a file (that may still turn into a split job)
+    vector<std::shared_ptr<SplitJob>> splitJobs;
+    condition_variable split_cv;
+    int busyCount = 0;
+    // Set while a worker streams an entry into the archive
+    bool archiveBusy = false;
+
+    // Finished entries waiting for the writer thread (if writeQueueSize is
+    // set), their total compressed size and some depth statistics
+    std::deque<ZipEntry> writeQueue;
+    uint64_t queuedBytes = 0;
+    condition_variable write_cv;
+    bool workersDone = false;
+    int maxDepth = 0;
+    uint64_t maxQueued = 0;
+    int64_t depthSum = 0;
+    int queueCount = 0;
+    int stallCount = 0;
+
+    // Must be called with 'm' locked
+    auto claimChunk = [&](std::shared_ptr<SplitJob>& job) -> int {
+        for (auto const& j : splitJobs) {
+            if (j->nextChunk < (int)j->chunks.size()) {
+                job = j;
+                return j->nextChunk++;
+            }
+        }
+        return -1;
+    };
+
+    // Time spent packing, summed over all files and chunks, and the
+    // longest single file or chunk. Used to report how close we got to the
+    // best possible total time. Time spent waiting for other threads is
+    // not work.
+    using Clock = std::chrono::steady_clock;
+    double workTime = 0;
+    double maxJobTime = 0;
+    auto secondsSince = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+
+    auto finishChunk = [&](SplitJob& job, double seconds) {
+        {
+            lock_guard lock{m};
+            job.doneChunks++;
+            workTime += seconds;
+            maxJobTime = std::max(maxJobTime, seconds);
+        }
+        split_cv.notify_all();
+    };
+
+    auto packSplitData = [&](const fs::path& source, uint64_t size,
+                             PackFormat format, uint8_t* sha,
+                             ZipEntry& target) {
+        auto job = std::make_shared<SplitJob>();
+        job->source = source;
+        job->size = size;
+        job->chunkSize = chunkSize;
+        job->level = format;
+        job->mapInput = mapInput;
+        job->populate = populateInput;
+        job->indexed = indexChunks;
+        job->chunks.resize((size + chunkSize - 1) / chunkSize);
+        const int count = job->chunks.size();
+        {
+            lock_guard lock{m};
+            splitJobs.push_back(job);
+        }
+        split_cv.notify_all();
+
+        // Signing needs the SHA1 of the whole file in order, so do that
+        // here while the other workers start on the chunks
+        auto const shaStart = Clock::now();
+        if (sha) {
+            File f{source};
+            SHA_CTX context;
+            SHA1_Init(&context);
+            // Read in pieces if it can not be mapped, rather than all of
+            // it into memory
+            auto input = mapInput ? FileMap::mapOnly(f, 0, size) : nullptr;
+            if (input)
+                SHA1_Update(&context, input->data(), size);
+            else {
+                auto buf = std::make_unique<uint8_t[]>(1024 * 1024);
+                while (auto rc = f.Read(buf.get(), 1024 * 1024))
+                    SHA1_Update(&context, buf.get(), rc);
+            }
+            SHA1_Final(sha, &context);
+        }
+        double ownTime = secondsSince(shaStart);
+
+        while (true) {
+            int i;
+            {
+                lock_guard lock{m};
+                if (job->nextChunk == count)
+                    break;
+                i = job->nextChunk++;
+            }
+            auto const chunkStart = Clock::now();
+            deflate_chunk(*job, i);
+            finishChunk(*job, secondsSince(chunkStart));
+        }
+        {
+            unique_lock lock{m};
+            while (job->doneChunks < count)
+                split_cv.wait(lock);
+            splitJobs.erase(
+                std::find(splitJobs.begin(), splitJobs.end(), job));
+        }
+
+        auto const joinStart = Clock::now();
+        if (!join_chunks(*job, target)) {
+            File f{source};
+            target.data = std::make_unique<uint8_t[]>(size);
+            target.dataSize = f.Read(target.data.get(), size);
+            target.originalSize = target.dataSize;
+            target.crc = crc32_fast(target.data.get(), target.dataSize);
+            target.store = true;
+        }
+        ownTime += secondsSince(joinStart);
+        lock_guard lock{m};
+        workTime += ownTime;
+        maxJobTime = std::max(maxJobTime, ownTime);
+    };
+
+    thread writerThread;
+    if (writeQueueSize > 0) {
+        writerThread = thread([&] {
+            while (true) {
+                ZipEntry entry;
+                {
+                    unique_lock lock{m};
+                    while ((writeQueue.empty() || archiveBusy) && !workersDone)
+                        write_cv.wait(lock);
+                    if (writeQueue.empty())
+                        return;
+                    entry = std::move(writeQueue.front());
+                    writeQueue.pop_front();
+                    queuedBytes -= entry.dataSize;
+                    archiveBusy = true;
+                }
+                seq_cv.notify_all();
+                zipArchive.add(entry);
+                {
+                    lock_guard lock{m};
+                    archiveBusy = false;
+                }
+                seq_cv.notify_all();
+            }
+        });
+    }
+
+    // Files in the order workers should start on them when scheduling
+    // largest first; the index in 'fileNames' is the index in the archive
+    vector<int> order(totalCount);
+    std::iota(order.begin(), order.end(), 0);
+    if (schedule == LARGEST_FIRST) {
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return fileNames[a].uncompSize > fileNames[b].uncompSize;
+        });
+    }
+
+    // With 'doSeq', finished files wait for their turn. So at most
+    // threadCount - 1 workers may run ahead of the output order, leaving
+    // one to pick up the lowest unclaimed index.
+    vector<bool> claimed(totalCount);
+    int claimCount = 0;
+    int nextJob = 0;
+    int nextIndex = 0;
+    int aheadCount = 0;
+
+    // Must be called with 'm' locked
+    auto claimJob = [&](bool& ahead) -> int {
+        claimCount++;
+        ahead = false;
+        if (schedule == FIFO)
+            return fileNames.claim();
+        while (claimed[nextIndex])
+            nextIndex++;
+        int index = nextIndex;
+        if (!doSeq || aheadCount < threadCount - 1) {
+            while (claimed[order[nextJob]])
+                nextJob++;
+            index = order[nextJob];
+        }
+        ahead = doSeq && index != nextIndex;
+        if (ahead)
+            aheadCount++;
+        claimed[index] = true;
+        return index;
+    };
+
+    const auto startTime = Clock::now();
+
+    // Walk the directory while workers start on the files already found
+    bool walking = streamWalk;
+    thread walkThread;
+    if (streamWalk) {
+        walkThread = thread([&] {
+            walkDir(dirWalks[0], threadCount, [&](FileTarget&& target) {
+                {
+                    lock_guard lock{m};
+                    fileNames.emplace_back(std::move(target));
+                }
+                split_cv.notify_one();
+            });
+            {
+                lock_guard lock{m};
+                walking = false;
+            }
+            split_cv.notify_all();
+        });
+    }
+
     vector<thread> workerThreads(threadCount);
 
     for (auto& workerThread : workerThreads) {
@@ -386,21 +1123,48 @@ void Fastzip::exec()
             while (true) {
                 FileTarget fileName;
                 int index;
+                bool ahead;
                 {
-                    lock_guard lock{m};
+                    std::shared_ptr<SplitJob> job;
+                    int chunk;
+                    unique_lock lock{m};
+                    while (true) {
+                        chunk = claimChunk(job);
+                        if (chunk >= 0 ||
+                            claimCount < (int)fileNames.size() ||
+                            (busyCount == 0 && !walking))
+                            break;
+                        // Another worker may still start splitting a file,
+                        // or the walker find more files
+                        split_cv.wait(lock);
+                    }
+
+                    if (chunk >= 0) {
+                        // Help out with a large file before taking a new
+                        lock.unlock();
+                        auto const chunkStart = Clock::now();
+                        deflate_chunk(*job, chunk);
+                        finishChunk(*job, secondsSince(chunkStart));
+                        continue;
+                    }
 
-                    if (fileNames.empty())
+                    if (claimCount == (int)fileNames.size())
                         return;
-                    fileName = fileNames.front();
-                    index = totalCount - fileNames.size();
-                    fileNames.pop_front();
+                    index = claimJob(ahead);
+                    fileName = fileNames[index];
+                    busyCount++;
                 }
+                auto const jobStart = Clock::now();
+                bool split = false;
 
                 bool skipFile = false;
                 ZipEntry entry;
                 bool isPacked = false;
-                uint32_t dataSize;
+                uint64_t dataSize;
                 File f{fileName.source};
+                fs::path source = fileName.source;
+                uint8_t sha[SHA_LEN];
+                bool knownSha = false;
 
                 if (doSign) {
                     if (fileName.target.substr(0, 8) == "META-INF") {
@@ -424,30 +1188,39 @@ void Fastzip::exec()
                     entry.timeStamp = msdosToUnixTime(le.dateTime);
                     entry.crc = le.crc;
                     f.seek(le.nameLen + le.exLen, File::Seek::Cur);
-                } else {
-                    struct stat ss;
-                    if (stat(fileName.source.c_str(), &ss) == 0) {
-                        entry.timeStamp = ss.st_mtime;
-                        entry.flags = ss.st_mode;
-                        entry.uid = ss.st_uid;
-                        entry.gid = ss.st_gid;
-                    } else {
-                        warning(string("Could not access ") +
-                                fileName.source.string());
-                        skipFile = true;
-                    }
-#ifndef _WIN32
-                    if (!skipFile && (ss.st_mode & S_IFLNK) == S_IFLNK) {
-                        warning(string("Skipping symlink ") +
-                                fileName.source.string());
-                        skipFile = true;
+
+                    if (needSha && isPacked) {
+                        if (auto const* known =
+                                findDigest(fileName, le.crc, le.uncompSize)) {
+                            memcpy(sha, known->sha, SHA_LEN);
+                            knownSha = true;
+                            digestHits++;
+                        }
                     }
-#endif
-                    if (!skipFile && (ss.st_mode & S_IFDIR)) {
-                        // Add directories?
-                        skipFile = true;
+                } else {
+                    // Directories and special files were dropped by the walk
+                    entry.timeStamp = fileName.mtime;
+                    entry.flags = fileName.mode;
+                    entry.uid = fileName.uid;
+                    entry.gid = fileName.gid;
+                    dataSize = entry.originalSize = fileName.uncompSize;
+
+                    // Unchanged since the base archive; copy it from there
+                    if (auto const* base = findBase(fileName)) {
+                        f.close();
+                        f.open(baseZip.string().c_str(), File::READ);
+                        source = baseZip;
+                        f.seek(base->offset);
+                        auto le = f.Read<LocalEntry>();
+                        f.seek(le.nameLen + le.exLen, File::Seek::Cur);
+                        dataSize = base->compSize;
+                        entry.originalSize = base->uncompSize;
+                        entry.crc = base->crc;
+                        isPacked = !base->stored;
+                        if (base->stored)
+                            fileName.packFormat = UNCOMPRESSED;
+                        baseHits++;
                     }
-                    dataSize = entry.originalSize = ss.st_size;
                 }
 
                 if (!skipFile) {
@@ -458,15 +1231,53 @@ void Fastzip::exec()
                     }
                 }
                 if (!skipFile) {
-                    uint8_t sha[SHA_LEN];
-
-                    packZipData(f, dataSize,
-                                isPacked ? COMPRESSED : UNCOMPRESSED,
-                                isPacked && fileName.packFormat > 0
-                                    ? COMPRESSED
-                                    : (PackFormat)fileName.packFormat,
-                                doSign ? sha : nullptr, entry);
+                    const bool deflate =
+                        fileName.packFormat >= ZIP1_COMPRESSED &&
+                        fileName.packFormat <= ZIP9_COMPRESSED;
+                    const bool stream =
+                        !isPacked && memoryBudget > 0 &&
+                        (deflate || fileName.packFormat == UNCOMPRESSED) &&
+                        dataSize + dataSize / 16 + 64 * 1024 > memoryBudget;
+
+                    if (stream) {
+                        {
+                            unique_lock lock{m};
+                            // Entries before this one must be written first
+                            while ((doSeq && (index != currentIndex ||
+                                              !writeQueue.empty())) ||
+                                   archiveBusy)
+                                seq_cv.wait(lock);
+                            archiveBusy = true;
+                        }
+                        packStreamData(f, dataSize, fileName.packFormat,
+                                       needSha ? sha : nullptr, entry,
+                                       zipArchive);
+                    } else if (!isPacked && deflate && splitSize > 0 &&
+                               threadCount > 1 && dataSize > splitSize) {
+                        f.close();
+                        // Counts its own work, without the wait for
+                        // the other threads
+                        split = true;
+                        packSplitData(fileName.source, dataSize,
+                                      fileName.packFormat,
+                                      needSha ? sha : nullptr, entry);
+                    } else if (isPacked && fileName.packFormat > 0 &&
+                               (!needSha || knownSha)) {
+                        // Kept as is, and nothing needs to look at it; the
+                        // archive copies it straight from the source file
+                        entry.store = false;
+                        entry.dataSize = dataSize;
+                        entry.copyFrom = source.string();
+                        entry.copyOffset = f.tell();
+                    } else
+                        packZipData(f, dataSize,
+                                    isPacked ? COMPRESSED : UNCOMPRESSED,
+                                    isPacked && fileName.packFormat > 0
+                                        ? COMPRESSED
+                                        : (PackFormat)fileName.packFormat,
+                                    needSha ? sha : nullptr, entry);
                     f.close();
+                    const double jobTime = secondsSince(jobStart);
 
                     if (verbose) {
                         int percent = 0;
@@ -479,26 +1290,70 @@ void Fastzip::exec()
                                entry.store ? 100 : percent);
                     }
 
+                    ZipArchive::Reservation slot;
+                    const bool queued = writeQueueSize > 0 && !stream;
                     {
                         unique_lock lock{m};
-                        if (doSeq) {
-                            while (index != currentIndex)
+                        if (queued) {
+                            // Block while the queue is full; a single entry
+                            // larger than the limit is still let through
+                            bool stalled = false;
+                            while (true) {
+                                const bool full =
+                                    !writeQueue.empty() &&
+                                    queuedBytes + entry.dataSize >
+                                        writeQueueSize;
+                                if (!full && !(doSeq && index != currentIndex))
+                                    break;
+                                stalled |= full;
                                 seq_cv.wait(lock);
+                            }
+                            stallCount += stalled;
+                        } else if (!stream) {
+                            while ((doSeq && index != currentIndex) ||
+                                   archiveBusy)
+                                seq_cv.wait(lock);
+                        }
+                        if (!split) {
+                            workTime += jobTime;
+                            maxJobTime = std::max(maxJobTime, jobTime);
                         }
                         if (doSign) {
-                            sprintf(digestPtr,
-                                    "Name: %s\015\012SHA1-Digest: "
-                                    "%s\015\012\015\012",
-                                    entry.name.c_str(),
-                                    base64_encode(sha, SHA_LEN).c_str());
-                            while (*digestPtr)
-                                digestPtr++;
+                            digestFile += "Name: " + entry.name +
+                                          "\015\012SHA1-Digest: " +
+                                          base64_encode(sha, SHA_LEN) +
+                                          "\015\012\015\012";
                         }
-                        zipArchive.add(entry);
+                        if (writeDigests) {
+                            char head[32];
+                            snprintf(head, sizeof(head), "%08x %llu ",
+                                     entry.crc,
+                                     (unsigned long long)entry.originalSize);
+                            digestIndex += head + base64_encode(sha, SHA_LEN) +
+                                           " " + entry.name + "\n";
+                        }
+                        if (stream)
+                            archiveBusy = false;
+                        else if (queued) {
+                            queuedBytes += entry.dataSize;
+                            writeQueue.push_back(std::move(entry));
+                            const int depth = writeQueue.size();
+                            maxDepth = std::max(maxDepth, depth);
+                            maxQueued = std::max(maxQueued, queuedBytes);
+                            depthSum += depth;
+                            queueCount++;
+                        } else
+                            slot = zipArchive.reserve(entry);
                         currentIndex++;
                     }
-                    if (doSeq)
+                    if (doSeq || stream)
                         seq_cv.notify_all();
+                    if (writeQueueSize > 0 && (queued || stream))
+                        write_cv.notify_all();
+                    // Write outside the lock, other workers only need the
+                    // reservation to go on
+                    if (!stream && !queued)
+                        zipArchive.writeEntry(slot, entry);
                 } else {
                     if (doSeq) {
                         {
@@ -511,12 +1366,65 @@ void Fastzip::exec()
                         seq_cv.notify_all();
                     }
                 }
+                {
+                    lock_guard lock{m};
+                    busyCount--;
+                    if (ahead)
+                        aheadCount--;
+                }
+                split_cv.notify_all();
             }
         });
     }
 
     for (int i = 0; i < threadCount; i++)
         workerThreads[i].join();
+    if (walkThread.joinable()) {
+        walkThread.join();
+        dirWalks.clear();
+        if (fileNames.empty()) {
+            zipArchive.close();
+            if (!updating)
+                fs::remove(tempFile, ec);
+            throw fastzip_exception("No paths specified");
+        }
+    }
+    if (fileNames.size() >= 65535)
+        warning("More than 64K files, adding 64bit features.");
+    if (verbose && !baseZip.empty())
+        printf("Reused %d of %d entries from %s\n", baseHits.load(),
+               (int)fileNames.size(), baseZip.string().c_str());
+    if (verbose && needSha && !knownDigests.empty())
+        printf("Reused %d SHA1 digests of added zips\n", digestHits.load());
+    if (verbose && cache) {
+        auto const stats = cache->stats();
+        printf("Cache: %d of %d hits (%d%%), %d added, %d evicted, %dMB "
+               "not compressed, %dMB in cache\n",
+               stats.hits, stats.lookups,
+               stats.lookups ? stats.hits * 100 / stats.lookups : 0,
+               stats.inserts, stats.evictions,
+               (int)(stats.savedBytes / (1024 * 1024)),
+               (int)(stats.cacheSize / (1024 * 1024)));
+    }
+    if (verbose) {
+        // No schedule can beat the longest file or perfectly shared work
+        const double ideal = std::max(maxJobTime, workTime / threadCount);
+        printf("Packed in %.2fs, ideal %.2fs\n", secondsSince(startTime),
+               ideal);
+    }
+    if (writerThread.joinable()) {
+        {
+            lock_guard lock{m};
+            workersDone = true;
+        }
+        write_cv.notify_all();
+        writerThread.join();
+        if (verbose && queueCount > 0)
+            printf("Writer queue: average depth %.1f, max %d entries (%dKB), "
+                   "%d stalls\n",
+                   (double)depthSum / queueCount, maxDepth,
+                   (int)(maxQueued / 1024), stallCount);
+    }
     /*
         if (ftell_x(zipArchive.getFile()) > (int64_t)0xff000000)
             throw fastzip_exception("Resulting file too large");
@@ -524,12 +1432,47 @@ void Fastzip::exec()
     if (doSign) {
         lock_guard lock{m};
         keyStore.setCurrentKey(keyName, keyPassword);
-        sign(zipArchive, keyStore, digestFile.get());
+        sign(zipArchive, keyStore, digestFile, signScheme);
     }
 
-    zipArchive.close();
+    ZipArchive::SigningBlock signingBlock;
+    if (doSign && signScheme >= 2) {
+        signingBlock = [&](const ContentDigest::Digest& digest) {
+            return apkSigningBlock(keyStore, digest, signScheme);
+        };
+    }
+    if (!zipArchive.close(signingBlock))
+        warning("Zip64 archives can not have an APK Signing Block; only "
+                "jar signed");
+    if (verbose && signingBlock) {
+        auto const stats = zipArchive.digestStats();
+        printf("Content digest: %d chunks, %.1f MB/s per thread, %d%% hashed "
+               "while writing\n",
+               stats.chunks,
+               stats.busy > 0 ? stats.bytes / stats.busy / (1024 * 1024) : 0,
+               stats.chunks > 0 ? stats.early * 100 / stats.chunks : 0);
+    }
+
+    if (updating) {
+        if (verbose) {
+            auto const stats = zipArchive.updateStats();
+            printf("Updated %s: %d entries kept, %d replaced, %d added in "
+                   "unused space, %d moved, %dKB unused\n",
+                   zipfile.string().c_str(), stats.kept, stats.replaced,
+                   stats.filled, stats.moved, (int)(stats.unused / 1024));
+        }
+        return;
+    }
 
     remove(zipfile.c_str());
     if (rename(tempFile.c_str(), zipfile.c_str()) != 0)
         throw fastzip_exception("Could not write target file");
+
+    if (writeDigests) {
+        File index{zipfile.string() + ".digests", File::WRITE};
+        if (!index.isOpen() ||
+            index.Write(digestIndex.data(), digestIndex.size()) !=
+                digestIndex.size())
+            throw fastzip_exception("Could not write digest index");
+    }
 }
@@ -6,6 +6,8 @@
 #include <cstdint>
 #include <experimental/filesystem>
 #include <functional>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 namespace fs = std::experimental::filesystem;
 
@@ -60,15 +62,28 @@ struct PathAlias
 struct FileTarget
 {
     FileTarget(const std::string& aSource = "", const std::string& aTarget = "",
-               PackFormat pf = INTEL_COMPRESSED, uint64_t offs = 0xffffffff)
-        : source(aSource), target(aTarget), packFormat(pf), offset(offs)
+               PackFormat pf = INTEL_COMPRESSED, uint64_t offs = 0xffffffff,
+               uint64_t usize = 0)
+        : source(aSource), target(aTarget), packFormat(pf), offset(offs),
+          uncompSize(usize)
     {}
 
     fs::path source;
     std::string target;
+    // If not 0, only this many bytes at 'offset' of 'source' are packed.
+    // Not the size of an entry of an added zip; that comes from its local
+    // header.
     uint64_t size = 0;
     PackFormat packFormat;
     uint64_t offset = 0xffffffff;
+    // Uncompressed size if known up front (of the file, or of the entry of
+    // an added zip), used for scheduling
+    uint64_t uncompSize = 0;
+    // File metadata from the directory walk
+    uint16_t mode = 0;
+    time_t mtime = 0;
+    int uid = 0;
+    int gid = 0;
 
     bool operator==(const FileTarget& other) const
     {
@@ -84,10 +99,18 @@ struct FileTarget
 struct ZipEntry;
 class ZipArchive;
 class File;
+class CompressCache;
+class ZipStream;
 
 class Fastzip
 {
 public:
+    enum Schedule
+    {
+        FIFO,         // Pack files in the order they were added
+        LARGEST_FIRST // Start on the biggest files first
+    };
+
     // Variables to be set by application code
     fs::path zipfile;
     bool verbose = false;
@@ -99,9 +122,53 @@ public:
     fs::path keystoreName;
     std::string keyPassword;
     std::string keyName;
+    // Highest APK signature scheme to sign with: 1 is jar signing only, 2
+    // adds an APK Signature Scheme v2 block, 3 adds v2 and v3 blocks
+    int signScheme = 1;
     int threadCount = 1;
     int earlyOut = 98;
     bool force64 = false;
+    // Files larger than this are split into chunks that all worker threads
+    // deflate in parallel. Off (0) by default, since it changes the output
+    // and costs a little compression.
+    uint64_t splitSize = 0;
+    uint64_t chunkSize = 4 * 1024 * 1024;
+    // Deflate the chunks of split files without a dictionary and list where
+    // they start in an extra field, so the entry can be inflated in
+    // parallel too. Costs a little compression.
+    bool indexChunks = false;
+    // Files that would need more buffer memory than this per thread are
+    // compressed in fixed windows straight into the archive. 0 = no limit.
+    uint64_t memoryBudget = 0;
+    // If set, workers hand finished entries to a dedicated writer thread.
+    // At most this many bytes of compressed data wait in its queue.
+    uint64_t writeQueueSize = 0;
+    Schedule schedule = FIFO;
+    // Read input files through mmap instead of stdio. 'populateInput'
+    // prefaults the whole mapping up front.
+    bool mapInput = false;
+    bool populateInput = false;
+    // Previous output archive. Files whose name, size and time match an
+    // entry in it are copied from there instead of being compressed again.
+    // With 'baseByContent', a time mismatch is forgiven if the CRC matches.
+    fs::path baseZip;
+    bool baseByContent = false;
+    // Directory of compressed file data from earlier runs, looked up by
+    // content before deflating a file. Trimmed to 'cacheSize' bytes.
+    fs::path cacheDir;
+    uint64_t cacheSize = 1024 * 1024 * 1024;
+    // If 'zipfile' exists, add and replace entries in it instead of writing
+    // a new archive. 'compact' then moves the entries together to drop the
+    // space that replaced entries leave behind.
+    bool update = false;
+    bool compact = false;
+    // Also write '<zipfile>.digests', with the CRC, size and SHA1 of every
+    // entry.
+    bool writeDigests = false;
+    // Read '<zip>.digests' of the zips added with addZip(), like the manifest
+    // of a signed jar, so signing needs no inflating of their entries. A
+    // digest is trusted if the CRC and size of the entry still match.
+    bool readDigests = false;
 
     // Add a file to be packed into the target zip
     void addZip(const fs::path& zipName, PackFormat format);
@@ -117,7 +184,7 @@ public:
         warning = std::move(f);
     }
 
-    size_t fileCount() { return fileNames.size(); }
+    size_t fileCount() { return fileNames.size() + dirWalks.size(); }
 
 private:
     std::function<void(const std::string)> warning =
@@ -125,10 +192,63 @@ private:
             fprintf(stderr, "**Warn: %s\n", text.c_str());
         };
 
+    struct DirWalk
+    {
+        fs::path dir;
+        std::string aliasTo;
+        int skipLen;
+        PackFormat format;
+        std::vector<std::string> storeExts;
+    };
+
+    // Walk a directory added with addDir(), calling 'add' for every file
+    void walkDir(const DirWalk& walk, int threads,
+                 const std::function<void(FileTarget&&)>& add);
+    // Add the files of all pending directories to fileNames
+    void walkDirs(int threads);
+
     void packZipData(File& f, int size, PackFormat inFormat,
                      PackFormat outFormat, uint8_t* sha, ZipEntry& target);
+    void packStreamData(File& f, uint64_t size, PackFormat outFormat,
+                        uint8_t* sha, ZipEntry& target,
+                        ZipArchive& zipArchive);
 
-    UniQueue<FileTarget> fileNames;
+    // Where an unchanged file can be found in 'baseZip'
+    struct BaseEntry
+    {
+        uint64_t offset;
+        uint64_t compSize;
+        uint64_t uncompSize;
+        uint32_t crc;
+        uint32_t dateTime;
+        bool stored;
+    };
+
+    // SHA1 of an entry of a zip added with addZip(), known from its
+    // manifest or digest index
+    struct KnownDigest
+    {
+        uint32_t crc;
+        uint64_t size;
+        uint8_t sha[20];
+    };
+
+    void loadDigests(const fs::path& zipName, ZipStream& zs);
+    void loadDigestIndex(const fs::path& zipName);
+    // The SHA1 of an entry of an added zip, if it is known and still matches
+    const KnownDigest* findDigest(const FileTarget& file, uint32_t crc,
+                                  uint64_t size);
+
+    void loadBase();
+    // The entry in the base archive that can be reused for a file, if any
+    const BaseEntry* findBase(const FileTarget& file);
+
+    WorkList<FileTarget, std::string, &FileTarget::target> fileNames;
+    std::vector<DirWalk> dirWalks;
+    std::unordered_map<std::string, BaseEntry> baseEntries;
+    std::shared_ptr<CompressCache> cache;
+    std::unordered_map<std::string, KnownDigest> knownDigests;
+    std::vector<fs::path> addedZips;
     int strLen = 0;
 
     KeyStore keyStore;
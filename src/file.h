@@ -1,12 +1,16 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 #include <cstring>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #ifdef _WIN32
 #    include <io.h>
 #else
+#    include <fcntl.h>
+#    include <sys/mman.h>
 #    include <unistd.h>
 #endif
 
@@ -41,7 +45,11 @@ public:
     enum Mode
     {
         READ = 1,
-        WRITE = 2
+        WRITE = 2,
+        // Read and write an existing file without truncating it
+        UPDATE = 3,
+        // Like WRITE, but the file can be read (and mapped) too
+        CREATE = 4
     };
 
     enum class OpenResult
@@ -159,6 +167,75 @@ public:
         return fwrite(target, 1, bytes, fp_);
     }
 
+    // Write at a given offset without moving the file position. Can be
+    // called from several threads at once, except on Windows.
+    template <typename T>
+    size_t writeAt(const T* source, size_t bytes, int64_t offset)
+    {
+#ifdef _WIN32
+        _fseeki64(fp_, offset, SEEK_SET);
+        return fwrite(source, 1, bytes, fp_);
+#else
+        auto* ptr = reinterpret_cast<const char*>(source);
+        size_t total = 0;
+        while (total < bytes) {
+            auto rc = pwrite(fileno(fp_), ptr + total, bytes - total,
+                             offset + total);
+            if (rc <= 0)
+                break;
+            total += rc;
+        }
+        return total;
+#endif
+    }
+
+    // Read from a given offset without moving the file position. Can be
+    // called from several threads at once, except on Windows.
+    template <typename T>
+    size_t readAt(T* target, size_t bytes, int64_t offset)
+    {
+#ifdef _WIN32
+        _fseeki64(fp_, offset, SEEK_SET);
+        return fread(target, 1, bytes, fp_);
+#else
+        auto* ptr = reinterpret_cast<char*>(target);
+        size_t total = 0;
+        while (total < bytes) {
+            auto rc = pread(fileno(fp_), ptr + total, bytes - total,
+                            offset + total);
+            if (rc <= 0)
+                break;
+            total += rc;
+        }
+        return total;
+#endif
+    }
+
+    // Cut the file off at 'size' bytes
+    bool truncate(uint64_t size)
+    {
+        fflush(fp_);
+#ifdef _WIN32
+        return _chsize_s(_fileno(fp_), size) == 0;
+#else
+        return ftruncate(fileno(fp_), size) == 0;
+#endif
+    }
+
+    // Reserve disk space for the first 'size' bytes, growing the file if
+    // needed. False if the space is not there, or can not be reserved on
+    // this platform.
+    bool allocate(uint64_t size)
+    {
+        fflush(fp_);
+#if defined(_WIN32) || defined(__APPLE__)
+        (void)size;
+        return false;
+#else
+        return posix_fallocate(fileno(fp_), 0, size) == 0;
+#endif
+    }
+
     bool atEnd() { return feof(fp_); }
 
     void seek(int64_t pos, int whence = Seek::Set)
@@ -181,7 +258,10 @@ public:
 
     bool open(const char* name, Mode mode) noexcept
     {
-        fp_ = fopen(name, mode == READ ? "rb" : "wb");
+        fp_ = fopen(name, mode == READ     ? "rb"
+                          : mode == WRITE  ? "wb"
+                          : mode == CREATE ? "w+b"
+                                           : "r+b");
         return fp_ != nullptr;
     }
 
@@ -204,6 +284,165 @@ private:
     FILE* fp_ = nullptr;
 };
 
+// Read only view of 'size' bytes at 'offset' in a file. The range is mmap'ed
+// if possible, otherwise it is read into 'buffer' (or an allocated buffer if
+// none is given). Does not move the file position.
+class FileMap
+{
+public:
+    // Smaller ranges are cheaper to read than to map
+    static constexpr size_t MIN_MAP_SIZE = 64 * 1024;
+
+    FileMap(File& f, uint64_t offset, size_t size, bool populate = false,
+            uint8_t* buffer = nullptr)
+        : size_(size)
+    {
+        if (size >= MIN_MAP_SIZE && map(f, offset, populate))
+            return;
+        if (!buffer) {
+            allocated_ = std::make_unique<uint8_t[]>(size);
+            buffer = allocated_.get();
+        }
+        size_t total = 0;
+#ifdef _WIN32
+        f.seek(offset);
+        total = f.Read(buffer, size);
+#else
+        while (total < size) {
+            auto rc = pread(fileno(f.filePointer()), buffer + total,
+                            size - total, offset + total);
+            if (rc <= 0)
+                break;
+            total += rc;
+        }
+#endif
+        if (total == size)
+            data_ = buffer;
+    }
+
+    // Map the range, never reading it into memory. nullptr if it can not
+    // be mapped (always on Windows).
+    static std::unique_ptr<FileMap> mapOnly(File& f, uint64_t offset,
+                                            size_t size)
+    {
+        std::unique_ptr<FileMap> fm{new FileMap(size)};
+        if (size == 0 || !fm->map(f, offset, false))
+            return nullptr;
+        return fm;
+    }
+
+    FileMap(const FileMap&) = delete;
+    FileMap& operator=(const FileMap&) = delete;
+
+    ~FileMap()
+    {
+#ifndef _WIN32
+        if (map_)
+            munmap(map_, mapSize_);
+#endif
+    }
+
+    // nullptr if the range could not be read
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool isMapped() const { return map_ != nullptr; }
+
+private:
+    explicit FileMap(size_t size) : size_(size) {}
+
+    bool map([[maybe_unused]] File& f, [[maybe_unused]] uint64_t offset,
+             [[maybe_unused]] bool populate)
+    {
+#ifndef _WIN32
+        const uint64_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+        const uint64_t start = offset & ~pageMask;
+        int flags = MAP_PRIVATE;
+#    ifdef MAP_POPULATE
+        if (populate)
+            flags |= MAP_POPULATE;
+#    endif
+        mapSize_ = size_ + (offset - start);
+        map_ = mmap(nullptr, mapSize_, PROT_READ, flags,
+                    fileno(f.filePointer()), start);
+        if (map_ != MAP_FAILED) {
+            madvise(map_, mapSize_, MADV_SEQUENTIAL);
+            data_ = static_cast<uint8_t*>(map_) + (offset - start);
+            return true;
+        }
+        map_ = nullptr;
+#endif
+        return false;
+    }
+
+    const uint8_t* data_ = nullptr;
+    size_t size_;
+    void* map_ = nullptr;
+    size_t mapSize_ = 0;
+    std::unique_ptr<uint8_t[]> allocated_;
+};
+
+// Writable view of the first 'size' bytes of a file, which is resized to
+// that. The file is mmap'ed if it was opened with CREATE or UPDATE, the
+// size is worth it and the disk space could be reserved first, so a full
+// disk fails here instead of raising SIGBUS on a write through the map.
+// Otherwise the data goes to a buffer that commit() writes out, if it is
+// at most MAX_BUFFER_SIZE; above that data() is nullptr and the caller has
+// to stream the file out itself.
+class OutputMap
+{
+public:
+    static constexpr size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+
+    OutputMap(File& f, size_t size) : file_(f), size_(size)
+    {
+#ifndef _WIN32
+        if (size >= FileMap::MIN_MAP_SIZE && f.allocate(size) &&
+            f.truncate(size)) {
+            map_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fileno(f.filePointer()), 0);
+            if (map_ != MAP_FAILED) {
+                data_ = static_cast<uint8_t*>(map_);
+                return;
+            }
+            map_ = nullptr;
+        }
+#endif
+        if (size <= MAX_BUFFER_SIZE) {
+            allocated_ = std::make_unique<uint8_t[]>(size);
+            data_ = allocated_.get();
+        }
+    }
+
+    OutputMap(const OutputMap&) = delete;
+    OutputMap& operator=(const OutputMap&) = delete;
+
+    ~OutputMap()
+    {
+#ifndef _WIN32
+        if (map_)
+            munmap(map_, size_);
+#endif
+    }
+
+    uint8_t* data() { return data_; }
+    size_t size() const { return size_; }
+    bool isMapped() const { return map_ != nullptr; }
+
+    // Write out the buffer, if not mapped. False if that failed. A mapping
+    // is written back by the kernel; its disk space was reserved up front.
+    bool commit()
+    {
+        return map_ || (data_ && file_.writeAt(data_, size_, 0) == size_);
+    }
+
+private:
+    File& file_;
+    uint8_t* data_ = nullptr;
+    size_t size_;
+    void* map_ = nullptr;
+    std::unique_ptr<uint8_t[]> allocated_;
+};
+
 template <bool REFERENCE> class LineReader
 {
     friend File;
@@ -1,5 +1,6 @@
 #include "funzip.h"
 #include "inflate.h"
+#include "pinflate.h"
 #include "utils.h"
 #include "zipformat.h"
 #include "zipstream.h"
@@ -25,22 +26,7 @@
 
 namespace fs = std::experimental::filesystem;
 
-static bool copyfile(File& fout, size_t size, File& fin)
-{
-    if (!fout.canWrite())
-        return false;
-    std::array<uint8_t, 65536 * 4> buf;
-    while (size > 0) {
-        auto rc = fin.Read(&buf[0], size < buf.size() ? size : buf.size());
-        if (rc == 0)
-            return rc;
-        size -= rc;
-        fout.Write(&buf[0], rc);
-    }
-    return true;
-}
-
-static int64_t uncompress(File& fout, int64_t inSize, File& fin)
+static int64_t uncompress(File& fout, const uint8_t* in, uint64_t inSize)
 {
     int64_t total = 0;
     std::array<uint8_t, 65536> buf;
@@ -48,39 +34,290 @@ static int64_t uncompress(File& fout, int64_t inSize, File& fin)
     mz_stream stream{};
     mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS);
 
-    auto data = std::make_unique<uint8_t[]>(inSize > 0 ? inSize : buf.size());
-
-    if (inSize > 0) {
-        fin.Read(&data[0], inSize);
-        stream.next_in = &data[0];
-        stream.avail_in = inSize;
-    }
+    stream.next_in = in;
     int rc = MZ_OK;
     while (rc == MZ_OK) {
-        if (inSize == 0 && stream.avail_in == 0) {
-            stream.next_in = &data[0];
-            stream.avail_in = fin.Read(&data[0], buf.size());
-            if (stream.avail_in == 0)
+        // mz_stream counts bytes in 32 bits
+        if (stream.avail_in == 0) {
+            if (inSize == 0)
                 break;
+            stream.avail_in = std::min<uint64_t>(inSize, 1 << 30);
+            inSize -= stream.avail_in;
         }
         stream.next_out = &buf[0];
         stream.avail_out = buf.size();
 
         rc = mz_inflate(&stream, MZ_SYNC_FLUSH);
         // Did we unpack anything?
-        if (stream.avail_out == buf.size())
-            return -1;
+        if (stream.avail_out == buf.size() && stream.avail_in > 0)
+            break;
         fout.Write(&buf[0], buf.size() - stream.avail_out);
         total += (buf.size() - stream.avail_out);
     }
+    mz_inflateEnd(&stream);
     if (rc < 0)
         throw funzip_exception("Inflate failed");
 
-    mz_inflate(&stream, MZ_FINISH);
+    return total;
+}
 
-    mz_inflateEnd(&stream);
+// mz_stream counts bytes in 32 bits
+static constexpr int64_t MAX_MINIZ_CALL = 0xffffffff;
 
-    return total;
+// For outputs that can't be mapped and are too big to buffer
+static void uncompressStreamed(File& fout, const uint8_t* in, int64_t inSize,
+                               int64_t outSize)
+{
+    if (uncompress(fout, in, inSize) != outSize)
+        throw funzip_exception("Inflate failed");
+}
+
+// Inflate an entry of known size with one call, straight from the mapped
+// archive into the (mapped) output file
+static void uncompressSized(File& fout, const uint8_t* in, int64_t inSize,
+                            int64_t outSize, FUnzip::Inflater inflater)
+{
+    OutputMap out{fout, (size_t)outSize};
+    if (!out.data()) {
+        uncompressStreamed(fout, in, inSize, outSize);
+        return;
+    }
+    bool ok;
+    if (inflater == FUnzip::FAST) {
+        ok = inflateFast(in, inSize, out.data(), outSize);
+    } else {
+        mz_stream stream{};
+        mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS);
+        stream.next_in = in;
+        stream.avail_in = inSize;
+        stream.next_out = out.data();
+        stream.avail_out = outSize;
+        ok = mz_inflate(&stream, MZ_FINISH) == MZ_STREAM_END &&
+             stream.avail_out == 0;
+        mz_inflateEnd(&stream);
+    }
+    if (!ok || !out.commit())
+        throw funzip_exception("Inflate failed");
+}
+
+// `compSize` and `uncompSize` hold the 32 bit values from the header, and
+// are replaced by the zip64 ones where those overflowed
+static void readExtra(const uint8_t* ptr, int exLen, int* uid, int* gid,
+                      int64_t* compSize = nullptr,
+                      int64_t* uncompSize = nullptr)
+{
+    Extra extra;
+    while (exLen >= 4) {
+        memcpy(&extra, ptr, 4);
+        if (extra.size + 4 > exLen)
+            break;
+        memcpy(extra.data, ptr + 4, extra.size);
+        ptr += (extra.size + 4);
+        exLen -= (extra.size + 4);
+        // printf("EXTRA %x\n", extra.id);
+        if (extra.id == 0x7875) {
+
+            *uid = extra.unix2.UID;
+            *gid = extra.unix2.GID;
+        } else if (extra.id == 0x01) {
+            // Only the sizes that overflowed are stored, in order
+            auto const* p = extra.data;
+            auto const* end = extra.data + extra.size;
+            auto read64 = [&](int64_t* value) {
+                if (!value || *value != 0xffffffff || p + 8 > end)
+                    return;
+                memcpy(value, p, 8);
+                p += 8;
+            };
+            read64(uncompSize);
+            read64(compSize);
+        } else if (extra.id == 0xd) {
+            std::string link((char*)extra.unix.var, extra.size - 12);
+            // printf("LINK:%s\n", link.c_str());
+        }
+    }
+}
+
+// The archive, mapped as a whole when possible. Otherwise (always on
+// Windows) every entry is mapped or read on its own, so a big archive never
+// has to fit in memory.
+struct Archive
+{
+    uint64_t size;
+    std::unique_ptr<FileMap> map;
+};
+
+// The local header of an entry, and where its data is
+struct LocalInfo
+{
+    LocalEntry le;
+    int uid = -1;
+    int gid = -1;
+    int64_t compSize;
+    int64_t uncompSize;
+    // Start of the entry data, and the bytes that can be read from there
+    const uint8_t* data;
+    uint64_t available;
+    // Holds the data if the archive is not mapped
+    std::unique_ptr<FileMap> map;
+};
+
+// 'f' is only read from if the archive is not mapped
+static LocalInfo readLocal(const Archive& archive, File& f,
+                           const ZipStream::Entry& e)
+{
+    LocalInfo info;
+    auto& le = info.le;
+    if (e.offset < 0 || e.offset + sizeof(LocalEntry) > archive.size)
+        throw funzip_exception("Bad local header");
+    std::vector<uint8_t> buffer;
+    const uint8_t* fields = nullptr;
+    if (archive.map) {
+        fields = archive.map->data() + e.offset;
+        memcpy(&le, fields, sizeof(LocalEntry));
+        fields += sizeof(LocalEntry);
+    } else if (f.readAt(&le, sizeof(LocalEntry), e.offset) !=
+               sizeof(LocalEntry))
+        throw funzip_exception("Bad local header");
+    uint64_t const dataOffset =
+        e.offset + sizeof(LocalEntry) + le.nameLen + le.exLen;
+    if (dataOffset > archive.size)
+        throw funzip_exception("Bad local header");
+    if (!archive.map) {
+        buffer.resize(le.nameLen + le.exLen);
+        if (f.readAt(buffer.data(), buffer.size(),
+                     e.offset + sizeof(LocalEntry)) != buffer.size())
+            throw funzip_exception("Bad local header");
+        fields = buffer.data();
+    }
+
+    info.compSize = le.compSize;
+    info.uncompSize = le.uncompSize;
+    readExtra(fields + le.nameLen, le.exLen, &info.uid, &info.gid,
+              &info.compSize, &info.uncompSize);
+    info.available = archive.size - dataOffset;
+    // Stored data and sized deflate streams must be inside the archive
+    if (info.compSize < 0 || (uint64_t)info.compSize > info.available ||
+        (le.method == 0 && (info.uncompSize < 0 ||
+                            (uint64_t)info.uncompSize > info.available)))
+        throw funzip_exception("Truncated entry");
+    if (archive.map) {
+        info.data = archive.map->data() + dataOffset;
+        return info;
+    }
+
+    // Only what the entry needs; the central directory has the size of
+    // streams that are followed by a data descriptor
+    if (le.method == 0)
+        info.available = info.uncompSize;
+    else if (info.compSize > 0)
+        info.available = info.compSize;
+    else
+        info.available = std::min(e.compSize, info.available);
+    info.map = std::make_unique<FileMap>(f, dataOffset, info.available);
+    if (!info.map->data())
+        throw funzip_exception("Could not read zip file");
+    info.data = info.map->data();
+    return info;
+}
+
+// A big deflated entry, extracted after the other files by all threads
+// together
+struct LargeEntry
+{
+    int entry;
+    std::string name;
+};
+
+// Every access point starts a deflate stream that does not refer back to
+// earlier data, so the segments between them can be inflated independently
+// and written in place.
+static void uncompressIndexed(const ZipStream::Entry& e,
+                              const std::string& name, const LocalInfo& ie,
+                              int threadCount)
+{
+    auto fout = File{name, File::Mode::CREATE};
+    if (!fout.canWrite())
+        return;
+    OutputMap out{fout, (size_t)ie.uncompSize};
+    if (!out.data()) {
+        uncompressStreamed(fout, ie.data, ie.compSize, ie.uncompSize);
+        return;
+    }
+
+    auto const& points = e.accessPoints;
+    auto segment = [&](size_t i) {
+        AccessPoint start{0, 0};
+        AccessPoint end{(uint64_t)ie.compSize, (uint64_t)ie.uncompSize};
+        if (i > 0)
+            start = points[i - 1];
+        if (i < points.size())
+            end = points[i];
+        return std::make_pair(start, end);
+    };
+
+    threadCount = std::min<int>(threadCount, points.size() + 1);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads(threadCount);
+    for (auto& t : threads) {
+        t = std::thread([&] {
+            while (!failed) {
+                size_t i = next++;
+                if (i > points.size())
+                    break;
+                auto [start, end] = segment(i);
+                auto const inSize = end.compOffset - start.compOffset;
+                auto const outSize = end.uncompOffset - start.uncompOffset;
+                if (end.compOffset < start.compOffset ||
+                    end.uncompOffset < start.uncompOffset ||
+                    end.compOffset > (uint64_t)ie.compSize ||
+                    end.uncompOffset > (uint64_t)ie.uncompSize ||
+                    inSize > MAX_MINIZ_CALL || outSize > MAX_MINIZ_CALL) {
+                    failed = true;
+                    break;
+                }
+
+                mz_stream stream{};
+                mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS);
+                stream.next_in = ie.data + start.compOffset;
+                stream.avail_in = inSize;
+                stream.next_out = out.data() + start.uncompOffset;
+                stream.avail_out = outSize;
+                // Only the last segment ends the deflate stream; the others
+                // stop at a sync flush
+                int rc = mz_inflate(&stream, MZ_SYNC_FLUSH);
+                mz_inflateEnd(&stream);
+                if (rc < 0 || stream.avail_out != 0) {
+                    failed = true;
+                    break;
+                }
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    if (failed || !out.commit())
+        throw funzip_exception("Inflate failed");
+}
+
+static void uncompressSpeculative(const std::string& name, const LocalInfo& ie,
+                                  int threadCount)
+{
+    auto fout = File{name, File::Mode::CREATE};
+    if (!fout.canWrite())
+        return;
+    OutputMap out{fout, (size_t)ie.uncompSize};
+    if (!out.data()) {
+        uncompressStreamed(fout, ie.data, ie.compSize, ie.uncompSize);
+        return;
+    }
+    // If it is not something we could split up, inflate it in one go
+    bool ok = inflateParallel(ie.data, ie.compSize, out.data(), ie.uncompSize,
+                              threadCount) ||
+              inflateFast(ie.data, ie.compSize, out.data(), ie.uncompSize);
+    if (!ok || !out.commit())
+        throw funzip_exception("Inflate failed");
 }
 
 void FUnzip::smartDestDir(ZipStream& zs)
@@ -148,32 +385,6 @@ static inline void setMeta(const std::string& name,
     }
 #endif
 }
-static void readExtra(File& f, int exLen, int* uid, int* gid,
-                      int64_t* compSize = nullptr,
-                      int64_t* uncompSize = nullptr)
-{
-    Extra extra;
-    while (exLen > 0) {
-        f.Read((uint8_t*)&extra, 4);
-        f.Read(extra.data, extra.size);
-        exLen -= (extra.size + 4);
-        // printf("EXTRA %x\n", extra.id);
-        if (extra.id == 0x7875) {
-
-            *uid = extra.unix2.UID;
-            *gid = extra.unix2.GID;
-        } else if (extra.id == 0x01) {
-            if (compSize)
-                *compSize = extra.zip64.compSize;
-            if (uncompSize)
-                *uncompSize = extra.zip64.uncompSize;
-        } else if (extra.id == 0xd) {
-            std::string link((char*)extra.unix.var, extra.size - 12);
-            // printf("LINK:%s\n", link.c_str());
-        }
-    }
-}
-
 void FUnzip::exec()
 {
     std::atomic<int> entryNum(0);
@@ -191,6 +402,13 @@ void FUnzip::exec()
         return;
     }
 
+    // All threads decode straight from one mapping of the whole archive, if
+    // it can be mapped
+    auto archiveFile = zs.dupFile();
+    auto const archiveSize = fs::file_size(zipName);
+    Archive archive{archiveSize,
+                    FileMap::mapOnly(archiveFile, 0, archiveSize)};
+
     if (destinationDir == "")
         smartDestDir(zs);
     if (destinationDir != "" &&
@@ -199,13 +417,16 @@ void FUnzip::exec()
 
     std::vector<int> links;
     std::vector<int> dirs;
+    std::vector<LargeEntry> large;
     std::mutex lm;
 
     std::vector<std::thread> workerThreads(threadCount);
 
     for (auto& t : workerThreads) {
-        t = std::thread([&zs, &entryNum, &lm, &links, &dirs, f = zs.dupFile(),
-                         verbose = verbose,
+        t = std::thread([&zs, &archive, &entryNum, &lm, &links, &dirs, &large,
+                         f = zs.dupFile(), verbose = verbose,
+                         threads = threadCount, speculate = speculateSize,
+                         inflater = inflater,
                          destDir = destinationDir]() mutable {
             while (true) {
                 unsigned en = entryNum++;
@@ -227,16 +448,10 @@ void FUnzip::exec()
                     continue;
                 }
 
-                f.seek(e.offset);
-                auto le = f.Read<LocalEntry>();
-
-                f.seek(le.nameLen, SEEK_CUR);
-                int gid = -1;
-                int uid = -1;
-                int64_t uncompSize = le.uncompSize;
-                int64_t compSize = le.compSize;
-                // Read extra fields
-                readExtra(f, le.exLen, &uid, &gid, &compSize, &uncompSize);
+                auto const info = readLocal(archive, f, e);
+                auto const& le = info.le;
+                auto const compSize = info.compSize;
+                auto const uncompSize = info.uncompSize;
                 auto name = destDir + e.name;
                 auto dname = path_directory(name);
                 if (dname != "" && !fileExists(dname))
@@ -246,11 +461,19 @@ void FUnzip::exec()
                     printf("%s\n", name.c_str());
                     fflush(stdout);
                 }
+                if (le.method == 8 && threads > 1 && compSize > 0 &&
+                    (!e.accessPoints.empty() ||
+                     (inflater == FAST && speculate > 0 &&
+                      uncompSize >= speculate))) {
+                    std::lock_guard<std::mutex> lock(lm);
+                    large.push_back({(int)en, name});
+                    continue;
+                }
                 // printf("%s %x %s %s\n", fileName, a, (a & S_IFDIR)  ==
                 // S_IFDIR ? "DIR" : "", (a & S_IFLNK) == S_IFLNK ? "LINK" :
                 // "");
 
-                auto fout = File{name, File::Mode::WRITE};
+                auto fout = File{name, File::Mode::CREATE};
                 if (!fout.canWrite()) {
                     // char errstr[128];
                     // strerror_r(errno, errstr, sizeof(errstr));
@@ -259,56 +482,61 @@ void FUnzip::exec()
                     continue;
                 }
                 if (le.method == 0)
-                    copyfile(fout, uncompSize, f);
+                    fout.Write(info.data, uncompSize);
+                else if (compSize > 0 && uncompSize > 0 &&
+                         (inflater == FAST || (compSize <= MAX_MINIZ_CALL &&
+                                               uncompSize <= MAX_MINIZ_CALL)))
+                    uncompressSized(fout, info.data, compSize, uncompSize,
+                                    inflater);
                 else
-                    uncompress(fout, compSize, f);
+                    // Size unknown (data descriptor); inflate until the
+                    // stream ends
+                    uncompress(fout, info.data,
+                               compSize > 0 ? compSize : info.available);
                 fout.close();
-                setMeta(name, e.flags, le.dateTime, uid, gid);
+                setMeta(name, e.flags, le.dateTime, info.uid, info.gid);
             }
         });
     }
     for (auto& t : workerThreads)
         t.join();
 
-    char linkName[65536];
-    int uid, gid;
-    auto f = zs.dupFile();
+    for (auto const& le : large) {
+        auto& e = zs.getEntry(le.entry);
+        auto const info = readLocal(archive, archiveFile, e);
+        if (e.accessPoints.empty())
+            uncompressSpeculative(le.name, info, threadCount);
+        else
+            uncompressIndexed(e, le.name, info, threadCount);
+        setMeta(le.name, e.flags, info.le.dateTime, info.uid, info.gid);
+    }
+
     for (int i : links) {
         auto& e = zs.getEntry(i);
-        f.seek(e.offset);
-        auto le = f.Read<LocalEntry>();
-
-        f.seek(le.nameLen, SEEK_CUR);
-        uid = gid = -1;
-        int64_t uncompSize = le.uncompSize;
-        readExtra(f, le.exLen, &uid, &gid, nullptr, &uncompSize);
-        f.Read(linkName, uncompSize);
-        linkName[uncompSize] = 0;
+        auto const info = readLocal(archive, archiveFile, e);
+        if (info.uncompSize < 0 || (uint64_t)info.uncompSize > info.available)
+            throw funzip_exception("Truncated entry");
+        std::string linkName((const char*)info.data, info.uncompSize);
         auto name = destinationDir + e.name;
         auto dname = path_directory(name);
         auto fname = path_filename(e.name);
         // int fd = open(dname.c_str(), 0);
         if (verbose)
             printf("Link %s/%s -> %s\n", dname.c_str(), fname.c_str(),
-                   linkName);
+                   linkName.c_str());
         fs::create_symlink(linkName, fname);
         // symlinkat(linkName, fd, fname.c_str());
         // close(fd);
-        setMeta(name, e.flags, le.dateTime, uid, gid, true);
+        setMeta(name, e.flags, info.le.dateTime, info.uid, info.gid, true);
     }
     for (int i : dirs) {
         auto& e = zs.getEntry(i);
-        f.seek(e.offset);
-        auto le = f.Read<LocalEntry>();
-
-        f.seek(le.nameLen, SEEK_CUR);
-        uid = gid = -1;
-        readExtra(f, le.exLen, &uid, &gid);
+        auto const info = readLocal(archive, archiveFile, e);
         auto name = destinationDir + e.name;
         auto l = name.length();
         if (name[l - 1] == '/')
             name = name.substr(0, l - 1);
-        setMeta(name, e.flags, le.dateTime, uid, gid);
+        setMeta(name, e.flags, info.le.dateTime, info.uid, info.gid);
     }
 
     if (zs.comment())
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <exception>
 #include <string>
 
@@ -19,11 +20,22 @@ private:
 class FUnzip
 {
 public:
+    enum Inflater
+    {
+        MINIZ, // mz_inflate(), streaming through a small buffer
+        FAST   // inflateFast(), with the whole entry in memory
+    };
+
     void exec();
     void smartDestDir(ZipStream& zs);
     // private:
     std::string zipName;
     int threadCount = 8;
+    // Deflated entries at least this big are inflated by all threads
+    // together, guessing where the deflate blocks start. 0 = never. Only
+    // done with the FAST inflater.
+    int64_t speculateSize = 16 * 1024 * 1024;
+    Inflater inflater = FAST;
     bool listFiles = false;
     bool verbose = false;
     std::string destinationDir;
@@ -8,12 +8,6 @@ void error(ZCONST char* msg)
     fprintf(stderr, "%s\n", msg);
 }
 
-void flush_outbuf(char* o_buf, unsigned* o_idx)
-{
-    printf("FLUSH?? %p %p\n", o_buf, (void*)o_idx);
-    // Not sure
-}
-
 // Random access to output data?
 
 int seekable()
@@ -27,9 +21,19 @@ struct BufData
     unsigned in_size;
     unsigned in_offset;
     IZDeflate* zid;
+    // Input is stored at the end of the output buffer
+    bool shared;
     bool fail;
+    // Called on each block of input shortly before deflate reads it
+    void (*scan)(void*, const char*, unsigned);
+    void* scan_handle;
+    unsigned scanned;
 };
 
+// Input is scanned this far ahead of the deflater, so it is still in cache
+// when read into the window
+static const unsigned SCAN_BLOCK = 256 * 1024;
+
 local unsigned mem_read(void* handle, char* target, unsigned size)
 {
     BufData* bufdata = (BufData*)handle;
@@ -38,7 +42,7 @@ local unsigned mem_read(void* handle, char* target, unsigned size)
     char* rp = bufdata->in_buf + bufdata->in_offset;
 
     // This will normally never trigger
-    if ((wp + 32768 > rp) && (bufdata->zid->out_buf < bufdata->in_buf)) {
+    if (bufdata->shared && wp + 32768 > rp) {
         bufdata->fail = true;
         return 0;
     }
@@ -48,6 +52,16 @@ local unsigned mem_read(void* handle, char* target, unsigned size)
     ulg left = bufdata->in_size - bufdata->in_offset;
     if (left < (ulg)size)
         size = left;
+    if (bufdata->scan) {
+        while (bufdata->scanned < bufdata->in_offset + size) {
+            unsigned n = bufdata->in_size - bufdata->scanned;
+            if (n > SCAN_BLOCK)
+                n = SCAN_BLOCK;
+            bufdata->scan(bufdata->scan_handle,
+                          bufdata->in_buf + bufdata->scanned, n);
+            bufdata->scanned += n;
+        }
+    }
     memcpy(target, rp, size);
     bufdata->in_offset += size;
 
@@ -88,7 +102,15 @@ Next buffer: Shift everything 3 bits to the left
 
 // INTERFACE
 
-int64_t iz_deflate(int level, char* tgt, char* src, ulg tgtsize, ulg srcsize)
+// Deflate `srcsize` bytes from `src` into `tgt`. Returns the number of bits
+// written, -1 on failure or -2 if the data should be stored. A preset
+// dictionary and sync flushing are used when compressing one segment of a
+// larger deflate stream; the result is then always byte aligned.
+// If given, `scan` sees all of the input (but not the dictionary) in order,
+// in blocks just ahead of the deflater, unless compression fails.
+int64_t iz_deflate(int level, char* tgt, char* src, ulg tgtsize, ulg srcsize,
+                   char* dict, unsigned dictsize, bool syncflush,
+                   void (*scan)(void*, const char*, unsigned), void* scanHandle)
 {
     ush att = (ush)UNKNOWN;
     ush flags = 0;
@@ -101,12 +123,19 @@ int64_t iz_deflate(int level, char* tgt, char* src, ulg tgtsize, ulg srcsize)
     buf.in_size = (unsigned)srcsize;
     buf.in_offset = 0;
     buf.zid = &zid;
+    buf.shared = src >= tgt && src < tgt + tgtsize;
     buf.fail = false;
+    buf.scan = scan;
+    buf.scan_handle = scanHandle;
+    buf.scanned = 0;
 
     zid.read_buf = mem_read;
     zid.read_handle = &buf;
     zid.window_size = 0L;
     zid.level = level;
+    zid.dict = (uch*)dict;
+    zid.dict_len = dict ? dictsize : 0;
+    zid.sync_flush = syncflush;
     memset(zid.window, 0, sizeof(zid.window));
 
     zid.bi_init(tgt, (unsigned)(tgtsize), FALSE);
@@ -123,3 +152,32 @@ int64_t iz_deflate(int level, char* tgt, char* src, ulg tgtsize, ulg srcsize)
     // printf("Last bits: %d\n", zid.last_bits);
     return ((out_total - 1) << 3) + zid.last_bits;
 }
+
+// Deflate everything `reader` returns, passing the output to `writer` each
+// time `buf` fills up. Returns the number of bytes written.
+int64_t iz_deflate_stream(int level,
+                          unsigned (*reader)(void*, char*, unsigned),
+                          void* readHandle,
+                          void (*writer)(void*, char*, unsigned),
+                          void* writeHandle, char* buf, ulg bufsize)
+{
+    ush att = (ush)UNKNOWN;
+    ush flags = 0;
+    int method = DEFLATE;
+
+    IZDeflate zid;
+    zid.read_buf = reader;
+    zid.read_handle = readHandle;
+    zid.write_buf = writer;
+    zid.write_handle = writeHandle;
+    zid.window_size = 0L;
+    zid.level = level;
+    // Output can not be rewritten, so never turn the data into a stored file
+    zid.use_descriptors = 1;
+    memset(zid.window, 0, sizeof(zid.window));
+
+    zid.bi_init(buf, (unsigned)bufsize, TRUE);
+    zid.ct_init(&att, &method);
+    zid.lm_init((zid.level != 0 ? zid.level : 1), &flags);
+    return (int64_t)zid.deflate();
+}
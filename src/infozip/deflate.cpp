@@ -157,11 +157,24 @@ void IZDeflate::lm_init (int pack_level, ush *a_flags)
     match_init(); /* initialize the asm code */
 #    endif
 
+    /* Place the preset dictionary first in the window; compression starts
+     * right after it.
+     */
+    if (dict_len > WSIZE) {
+        dict += dict_len - WSIZE;
+        dict_len = WSIZE;
+    }
+    if (dict_len > 0) {
+        memcpy((char*)window, (char*)dict, dict_len);
+        strstart = dict_len;
+        block_start = (long)dict_len;
+    }
+
     j = WSIZE;
 #    ifndef MAXSEG_64K
     if (sizeof(int) > 2) j <<= 1; /* Can read 64K in one step */
 #    endif
-    lookahead = (*read_buf)(read_handle, (char*)window, j);
+    lookahead = (*read_buf)(read_handle, (char*)window + strstart, j - strstart);
 
     if (lookahead == 0 || lookahead == (unsigned)EOF) {
         eofile = 1, lookahead = 0;
@@ -173,9 +186,20 @@ void IZDeflate::lm_init (int pack_level, ush *a_flags)
      */
     if (lookahead < MIN_LOOKAHEAD) fill_window();
 
+    /* Insert all dictionary strings so matches can reach back into it */
+    if (dict_len > 0) {
+        IPos hash_head;
+        ins_h = 0;
+        for (j = 0; j < MIN_MATCH - 1; j++)
+            UPDATE_HASH(ins_h, window[j]);
+        for (j = 0; j < dict_len; j++)
+            INSERT_STRING(j, hash_head);
+        (void)hash_head;
+    }
+
     ins_h = 0;
     for (j = 0; j < MIN_MATCH - 1; j++)
-        UPDATE_HASH(ins_h, window[j]);
+        UPDATE_HASH(ins_h, window[strstart + j]);
     /* If lookahead < MIN_MATCH, ins_h is garbage, but this is
      * not important since only literal bytes will be emitted.
      */
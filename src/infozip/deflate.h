@@ -511,6 +511,11 @@ struct IZDeflate
     // Set to function read more data
     unsigned (*read_buf)(void* handle, char* buf, unsigned size);
 
+    // Set to function receiving output when flushing is allowed
+    void (*write_buf)(void* handle, char* buf, unsigned size) = NULL;
+    void* write_handle = NULL;
+    void flush_out(char* buf, unsigned* size);
+
     zoff_t dot_size = 0;  /* if not 0 then display dots every size buffers */
     zoff_t dot_count = 0; /* if dot_size not 0 counts buffers */
     /* status 10/30/04 */
@@ -525,4 +530,16 @@ struct IZDeflate
     int use_descriptors = 0;   /* use data descriptors (extended headings) */
 
     void* read_handle;
+
+    /* Optional preset dictionary (at most WSIZE bytes) that matches may
+     * refer back into. Used when compressing one segment of a larger stream.
+     */
+    uch* dict = NULL;
+    unsigned dict_len = 0;
+
+    /* If set, the last block is not marked final and is followed by an
+     * empty stored block, leaving the output byte aligned so it can be
+     * joined with the deflate data of the next segment.
+     */
+    int sync_flush = 0;
 };
@@ -141,14 +141,14 @@ void IZDeflate::init_desc() {
 /* Output a 16 bit value to the bit stream, lower (oldest) byte first */
 #define PUTSHORT(w) \
 { if (out_offset >= out_size-1) \
-    flush_outbuf(out_buf, &out_offset); \
+    flush_out(out_buf, &out_offset); \
   out_buf[out_offset++] = (char) ((w) & 0xff); \
   out_buf[out_offset++] = (char) ((ush)(w) >> 8); \
 }
 
 #define PUTBYTE(b) \
 { if (out_offset >= out_size) \
-    flush_outbuf(out_buf, &out_offset); \
+    flush_out(out_buf, &out_offset); \
   out_buf[out_offset++] = (char) (b); \
 }
 
@@ -742,6 +742,7 @@ uzoff_t IZDeflate::flush_block(char *buf, ulg stored_len, int eof)
 {
     ulg opt_lenb, static_lenb; /* opt_len and static_len in bytes */
     int max_blindex;  /* index of last bit length code of non zero freq */
+    int last = eof && !sync_flush; /* true if the final bit should be set */
 
     flag_buf[last_flags] = flags; /* Save the flags for the last 8 items */
 
@@ -785,9 +786,9 @@ uzoff_t IZDeflate::flush_block(char *buf, ulg stored_len, int eof)
         cmpr_bytelen == (uzoff_t)0 && cmpr_len_bits == 0L
        ) { /* force stored file */
 #else
-    if (stored_len <= opt_lenb && eof && file_method != NULL &&
+    if (stored_len <= opt_lenb && last && file_method != NULL &&
         cmpr_bytelen == (uzoff_t)0 && cmpr_len_bits == 0L &&
-        seekable() && !use_descriptors) {
+        dict_len == 0 && seekable() && !use_descriptors) {
 #endif
         /* Since LIT_BUFSIZE <= 2*WSIZE, the input data must be there: */
         if (buf == NULL) error ("block vanished");
@@ -810,7 +811,7 @@ uzoff_t IZDeflate::flush_block(char *buf, ulg stored_len, int eof)
          * successful. If LIT_BUFSIZE <= WSIZE, it is never too late to
          * transform a block into a stored block.
          */
-        send_bits((STORED_BLOCK<<1)+eof, 3);  /* send block type */
+        send_bits((STORED_BLOCK<<1)+last, 3);  /* send block type */
         cmpr_bytelen += ((cmpr_len_bits + 3 + 7) >> 3) + stored_len + 4;
         cmpr_len_bits = 0L;
 
@@ -821,13 +822,13 @@ uzoff_t IZDeflate::flush_block(char *buf, ulg stored_len, int eof)
 #else
     } else if (static_lenb == opt_lenb) {
 #endif
-        send_bits((STATIC_TREES<<1)+eof, 3);
+        send_bits((STATIC_TREES<<1)+last, 3);
         compress_block((ct_data near *)static_ltree, (ct_data near *)static_dtree);
         cmpr_len_bits += 3 + static_len;
         cmpr_bytelen += cmpr_len_bits >> 3;
         cmpr_len_bits &= 7L;
     } else {
-        send_bits((DYN_TREES<<1)+eof, 3);
+        send_bits((DYN_TREES<<1)+last, 3);
         send_all_trees(l_desc.max_code+1, d_desc.max_code+1, max_blindex+1);
         compress_block((ct_data near *)dyn_ltree, (ct_data near *)dyn_dtree);
         cmpr_len_bits += 3 + opt_len;
@@ -838,6 +839,14 @@ uzoff_t IZDeflate::flush_block(char *buf, ulg stored_len, int eof)
             "bad compressed size");
     init_block();
 
+    if (eof && sync_flush) {
+        /* Empty stored block; aligns the output to a byte boundary */
+        send_bits(STORED_BLOCK<<1, 3);
+        cmpr_bytelen += ((cmpr_len_bits + 3 + 7) >> 3) + 4;
+        cmpr_len_bits = 0L;
+        copy_block((char*)window, 0, 1);
+    }
+
     if (eof) {
 #if defined(PGP) && !defined(MMAP)
         /* Wipe out sensitive data for pgp */
@@ -1099,7 +1108,7 @@ void IZDeflate::bi_windup()
         PUTBYTE(bi_buf);
     }
     if (flush_flg) {
-        flush_outbuf(out_buf, &out_offset);
+        flush_out(out_buf, &out_offset);
     }
 
     last_bits = bi_valid;
@@ -1113,6 +1122,20 @@ void IZDeflate::bi_windup()
 #endif
 }
 
+/* ===========================================================================
+ * Pass the buffered output on to write_buf and empty the buffer.
+ */
+void IZDeflate::flush_out(char *buf, unsigned *size)
+{
+    if (write_buf == NULL) {
+        error("output buffer too small for in-memory compression");
+        return;
+    }
+    if (*size > 0)
+        (*write_buf)(write_handle, buf, *size);
+    *size = 0;
+}
+
 /* ===========================================================================
  * Copy a stored block to the zip file, storing first the length and its
  * one's complement if requested.
@@ -1169,7 +1192,7 @@ void IZDeflate::copy_block(char *block, unsigned len, int header)
 #endif
     }
     if (flush_flg) {
-        flush_outbuf(out_buf, &out_offset);
+        flush_out(out_buf, &out_offset);
         if (key != (char *)NULL) {  /* key is the global password pointer */
             /* Encryption modifies the data in the output buffer. But the
              * copied input data must remain intact for further deflate
@@ -1182,7 +1205,7 @@ void IZDeflate::copy_block(char *block, unsigned len, int header)
                 memcpy(out_buf, block, out_offset);
                 block += out_offset;
                 len -= out_offset;
-                flush_outbuf(out_buf, &out_offset);
+                flush_out(out_buf, &out_offset);
             }
         } else {
             /* Without encryption, the output routines do not touch the
@@ -1190,7 +1213,7 @@ void IZDeflate::copy_block(char *block, unsigned len, int header)
              * operation.
              */
             out_offset = len;
-            flush_outbuf(block, &out_offset);
+            flush_out(block, &out_offset);
         }
     } else if (out_offset + len > out_size) {
         error("output buffer too small for in-memory compression");
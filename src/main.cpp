@@ -1,6 +1,8 @@
 #include "fastzip.h"
 #include "funzip.h"
+#include "sign.h"
 #include "utils.h"
+#include "ziparchive.h"
 
 #include <cctype>
 #include <cstdio>
@@ -37,10 +39,43 @@ Usage: fastzip [options] <zipfile> <paths...>
 -d | --destination                     Destination directory for extraction.
                                        Defaults to 'smart' root directory. Use
                                        '-d .' for standard (unzip) behavour. 
+     --inflate=fast|miniz              Inflater to extract with. Default
+                                       fast.
 -X | x                                 Extract mode. Options below are ignored.      
 -S | --sign[=<kstore>[,<pw>[,<name>]]] Jarsign the zip using the keystore file.
+     --scheme=<1|2|3>                  Highest APK signature scheme to sign
+                                       with. Default 1 (jar only).
+     --verify                          Check the APK Signature Scheme v2/v3
+                                       signatures of <zipfile>.
 -e | --early-out=<percent>             Set worst detected compression for
                                        switching to store. Default 98.
+     --split=<MB>                      Deflate files larger than this in
+                                       parallel chunks. Off by default.
+     --index                           Make split files extractable in
+                                       parallel (by fastzip) too.
+     --mem=<MB>                        Per thread memory budget. Larger
+                                       files are streamed into the zip.
+     --writer=<MB>                     Write the zip from a separate thread,
+                                       queueing at most <MB> of entries.
+     --schedule=fifo|largest-first     Order in which files are packed.
+                                       Output order is unaffected with -s.
+     --mmap[=populate]                 Map input files into memory instead
+                                       of reading them.
+     --base=<zipfile>[,content]        Copy files that are unchanged (same
+                                       name, size and time) from a previous
+                                       build of the zip. With 'content', a
+                                       matching CRC is enough.
+-u | --update                          Add and replace files in an existing
+                                       <zipfile> instead of recreating it.
+     --compact                         With --update, remove unused space
+                                       left by replaced files.
+     --digests                         Write <zipfile>.digests with the SHA1
+                                       of every entry. Read the .digests of
+                                       zips added with -Z, to sign without
+                                       inflating them.
+     --cache=<dir>[,<MB>]              Keep compressed files in <dir> and
+                                       reuse them when the same content is
+                                       packed again. Default limit 1024MB.
 )"
 #ifdef WITH_INTEL
     "-I | --intel                           Intel-mode. Fast compression.\n"
@@ -111,6 +146,8 @@ int main(int argc, char** argv)
     fs::path destDir;
     bool extractMode = false;
     bool listFiles = false;
+    bool verifyMode = false;
+    FUnzip::Inflater inflater = FUnzip::FAST;
 
     auto packFormat = [&]() -> PackFormat {
         return (packLevel == 0 || packMode == INFOZIP ? (PackFormat)packLevel
@@ -172,6 +209,70 @@ int main(int argc, char** argv)
                 if (args.size() == 1) {
                     fastZip.earlyOut = std::stol(args[0]);
                 }
+            } else if (name == "split") {
+                if (args.size() != 1)
+                    error("'split' needs exactly one argument");
+                fastZip.splitSize = std::stoll(args[0]) * 1024 * 1024;
+            } else if (name == "inflate") {
+                if (args.size() != 1)
+                    error("'inflate' needs exactly one argument");
+                if (args[0] == "fast")
+                    inflater = FUnzip::FAST;
+                else if (args[0] == "miniz")
+                    inflater = FUnzip::MINIZ;
+                else
+                    error("Unknown inflater");
+            } else if (name == "index") {
+                fastZip.indexChunks = true;
+            } else if (name == "mem") {
+                if (args.size() != 1)
+                    error("'mem' needs exactly one argument");
+                fastZip.memoryBudget = std::stoll(args[0]) * 1024 * 1024;
+            } else if (name == "writer") {
+                if (args.size() != 1)
+                    error("'writer' needs exactly one argument");
+                fastZip.writeQueueSize = std::stoll(args[0]) * 1024 * 1024;
+            } else if (name == "mmap") {
+                fastZip.mapInput = true;
+                if (args.size() == 1 && args[0] == "populate")
+                    fastZip.populateInput = true;
+                else if (!args.empty())
+                    error("Unknown mmap option");
+            } else if (name == "scheme") {
+                if (args.size() != 1 || args[0].size() != 1 ||
+                    args[0][0] < '1' || args[0][0] > '3')
+                    error("'scheme' needs to be 1, 2 or 3");
+                fastZip.signScheme = args[0][0] - '0';
+            } else if (name == "base") {
+                if (args.empty() || args.size() > 2 ||
+                    (args.size() == 2 && args[1] != "content"))
+                    error("Usage: --base=<zipfile>[,content]");
+                fastZip.baseZip = args[0];
+                fastZip.baseByContent = args.size() == 2;
+            } else if (name == "update" || opt == 'u') {
+                fastZip.update = true;
+            } else if (name == "compact") {
+                fastZip.compact = true;
+            } else if (name == "digests") {
+                fastZip.writeDigests = true;
+                fastZip.readDigests = true;
+            } else if (name == "cache") {
+                if (args.empty() || args.size() > 2)
+                    error("Usage: --cache=<dir>[,<MB>]");
+                fastZip.cacheDir = args[0];
+                if (args.size() == 2)
+                    fastZip.cacheSize = std::stoll(args[1]) * 1024 * 1024;
+            } else if (name == "verify") {
+                verifyMode = true;
+            } else if (name == "schedule") {
+                if (args.size() != 1)
+                    error("'schedule' needs exactly one argument");
+                if (args[0] == "fifo")
+                    fastZip.schedule = Fastzip::FIFO;
+                else if (args[0] == "largest-first")
+                    fastZip.schedule = Fastzip::LARGEST_FIRST;
+                else
+                    error("Unknown schedule");
             } else if (name == "junk-paths" || opt == 'j') {
                 fastZip.junkPaths = true;
             } else if (name == "add-zip" || opt == 'Z') {
@@ -231,14 +332,15 @@ int main(int argc, char** argv)
         }
     }
 
-    if (!isatty(fileno(stdin))) {
+    if (!isatty(fileno(stdin)) && !verifyMode) {
         for (const auto& line : File::getStdIn().lines()) {
             fastZip.addDir(line, packFormat());
         }
     }
 
     // If only a directory is given, pack that to a zip
-    if (fastZip.fileCount() == 0 && fs::exists(fastZip.zipfile)) {
+    if (!verifyMode && !fastZip.update && fastZip.fileCount() == 0 &&
+        fs::exists(fastZip.zipfile)) {
         std::string ext = fastZip.zipfile.extension();
         puts(ext.c_str());
         if (ext == ".zip" || ext == ".ZIP") {
@@ -252,10 +354,29 @@ int main(int argc, char** argv)
 
     if (fastZip.zipfile == "") {
         puts(helpText);
+    } else if (verifyMode) {
+        try {
+            ContentDigest::Stats stats;
+            const int scheme =
+                verifyApk(fastZip.zipfile, fastZip.threadCount, &stats);
+            if (scheme < 2)
+                error("No APK Signing Block");
+            printf("Verified APK Signature Scheme v%d\n", scheme);
+            if (fastZip.verbose)
+                printf("Content digest: %d chunks in %.2fs, %.1f MB/s per "
+                       "thread\n",
+                       stats.chunks, stats.elapsed,
+                       stats.busy > 0
+                           ? stats.bytes / stats.busy / (1024 * 1024)
+                           : 0);
+        } catch (sign_exception& e) {
+            error(e.what());
+        }
     } else if (extractMode) {
         FUnzip fuz;
         fuz.zipName = fastZip.zipfile;
         fuz.threadCount = fastZip.threadCount;
+        fuz.inflater = inflater;
         fuz.verbose = fastZip.verbose;
         fuz.listFiles = listFiles;
         fuz.destinationDir = destDir;
@@ -270,6 +391,8 @@ int main(int argc, char** argv)
             fastZip.exec();
         } catch (fastzip_exception& e) {
             error(e.what());
+        } catch (zip_exception& e) {
+            error(e.msg);
         }
     }
 
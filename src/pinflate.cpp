@@ -0,0 +1,752 @@
+#include "pinflate.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+constexpr size_t WINDOW_SIZE = 32768;
+// Parts smaller than this (compressed) are not worth a thread
+constexpr size_t MIN_PART = 256 * 1024;
+// A guessed part may inflate to at most this many times its compressed
+// size. Its markers take two bytes per output byte, so this bounds the
+// memory per thread; data that compresses better is inflated serially.
+constexpr size_t MAX_PART_RATIO = 8;
+// Bits looked up at once; enough for most codes, or for two short literals
+constexpr int FAST_BITS = 11;
+// Room left at the end of the output for the fast loop: a maximum length
+// match plus what the wide copies may write past it
+constexpr size_t FAST_SLACK = 258 + 32;
+constexpr uint64_t NO_STOP = std::numeric_limits<uint64_t>::max();
+
+const uint16_t LEN_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                               15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                               67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                               2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DIST_BASE[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// LSB first bit reader over the whole input. Reads past the end return
+// zeroes; overrun() tells if any were used.
+class BitReader
+{
+public:
+    BitReader(const uint8_t* data, size_t size, uint64_t bit)
+        : data_(data), size_(size), pos_(bit / 8)
+    {
+        refill();
+        consume(bit & 7);
+    }
+
+    // Make sure at least 56 bits are buffered
+    void refill()
+    {
+        if (canRefillFast()) {
+            refillFast();
+            return;
+        }
+        while (count_ <= 56) {
+            uint64_t const b = pos_ < size_ ? data_[pos_] : 0;
+            bits_ |= b << count_;
+            pos_++;
+            count_ += 8;
+        }
+    }
+
+    // True while the input has 8 bytes left for refillFast()
+    bool canRefillFast() const { return pos_ + 8 <= size_; }
+    void refillFast()
+    {
+        uint64_t v;
+        memcpy(&v, data_ + pos_, 8);
+        bits_ |= v << count_;
+        pos_ += (63 - count_) >> 3;
+        count_ |= 56;
+    }
+
+    uint32_t peek(int n) const { return bits_ & ((1ULL << n) - 1); }
+    void consume(int n)
+    {
+        bits_ >>= n;
+        count_ -= n;
+    }
+    uint32_t get(int n)
+    {
+        auto const v = peek(n);
+        consume(n);
+        return v;
+    }
+
+    uint64_t bitPos() const { return pos_ * 8 - count_; }
+    bool overrun() const { return bitPos() > size_ * 8; }
+
+    // Skip to the next byte boundary and return 'n' bytes from there
+    const uint8_t* bytes(size_t n)
+    {
+        auto const start = (bitPos() + 7) / 8;
+        if (start + n > size_)
+            return nullptr;
+        pos_ = start + n;
+        bits_ = 0;
+        count_ = 0;
+        return data_ + start;
+    }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t pos_;
+    uint64_t bits_ = 0;
+    int count_ = 0;
+};
+
+class Huffman
+{
+public:
+    // Returns false unless the lengths make a complete prefix code. Like
+    // zlib, a single code of length one (or none at all) is accepted unless
+    // 'strict' is set.
+    bool build(const uint8_t* lengths, int n, bool strict = false)
+    {
+        memset(count_, 0, sizeof(count_));
+        for (int i = 0; i < n; i++)
+            count_[lengths[i]]++;
+        count_[0] = 0;
+
+        int left = 1;
+        int maxLen = 0;
+        for (int len = 1; len < 16; len++) {
+            left = (left << 1) - count_[len];
+            if (left < 0)
+                return false;
+            if (count_[len])
+                maxLen = len;
+        }
+        if (left > 0 && (strict || maxLen > 1))
+            return false;
+
+        uint16_t offset[16];
+        offset[1] = 0;
+        for (int len = 1; len < 15; len++)
+            offset[len + 1] = offset[len] + count_[len];
+        for (int i = 0; i < n; i++) {
+            if (lengths[i])
+                symbol_[offset[lengths[i]]++] = i;
+        }
+
+        // Codes are stored MSB first, so their table index is bit reversed
+        memset(fast_, 0, sizeof(fast_));
+        int code = 0;
+        int k = 0;
+        for (int len = 1; len <= FAST_BITS; len++) {
+            for (int c = 0; c < count_[len]; c++, k++, code++) {
+                int rev = 0;
+                for (int b = 0; b < len; b++)
+                    rev |= ((code >> b) & 1) << (len - 1 - b);
+                for (int i = rev; i < (1 << FAST_BITS); i += 1 << len)
+                    fast_[i] = symbol_[k] << 4 | len;
+            }
+            code <<= 1;
+        }
+        return true;
+    }
+
+    // symbol << 4 | length of the code at the start of 'bits', 0 if longer
+    // than FAST_BITS
+    uint16_t entry(uint32_t bits) const { return fast_[bits]; }
+
+    // Needs 15 buffered bits. Returns -1 for codes that are not in the table.
+    int decode(BitReader& br) const
+    {
+        auto const e = fast_[br.peek(FAST_BITS)];
+        if (e) {
+            br.consume(e & 15);
+            return e >> 4;
+        }
+        // Longer codes are decoded a bit at a time, as in zlib's puff
+        auto const bits = br.peek(15);
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (int len = 1; len < 16; len++) {
+            code |= (bits >> (len - 1)) & 1;
+            int const count = count_[len];
+            if (code - first < count) {
+                br.consume(len);
+                return symbol_[index + code - first];
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+private:
+    // symbol << 4 | length for codes of at most FAST_BITS bits, else 0
+    uint16_t fast_[1 << FAST_BITS];
+    uint16_t count_[16];
+    uint16_t symbol_[288];
+};
+
+// The literal/length code, with a second table for the fast loop that
+// decodes up to two literals, or a length with its base and extra bit
+// count, with one lookup. Codes that are too long have no entry (0) and
+// are decoded by 'code'.
+struct LiteralTable
+{
+    // Entries: bits used in 24-27, and either the number of literals in
+    // 30-31 with the literals in 0-7 and 8-15, or a flag in 28/29 with the
+    // length base in 0-8 and its extra bits in 9-12.
+    enum : uint32_t
+    {
+        END = 1U << 28,
+        LENGTH = 1U << 29
+    };
+
+    Huffman code;
+    uint32_t multi[1 << FAST_BITS];
+
+    bool build(const uint8_t* lengths, int n)
+    {
+        if (!code.build(lengths, n))
+            return false;
+        for (uint32_t i = 0; i < (1 << FAST_BITS); i++) {
+            uint32_t const e = code.entry(i);
+            uint32_t const len = e & 15;
+            uint32_t const sym = e >> 4;
+            if (!e || sym > 285) {
+                multi[i] = 0;
+            } else if (sym == 256) {
+                multi[i] = END | len << 24;
+            } else if (sym > 256) {
+                multi[i] = LENGTH | len << 24 | LEN_EXTRA[sym - 257] << 9 |
+                           LEN_BASE[sym - 257];
+            } else {
+                // The bits after the first code only give a whole second
+                // code if it is short enough
+                uint32_t const e2 = code.entry(i >> len);
+                uint32_t const len2 = e2 & 15;
+                if (e2 && len2 <= FAST_BITS - len && (e2 >> 4) < 256)
+                    multi[i] = 2U << 30 | (len + len2) << 24 | (e2 >> 4) << 8 | sym;
+                else
+                    multi[i] = 1U << 30 | len << 24 | sym;
+            }
+        }
+        return true;
+    }
+};
+
+// The distance code, with a table of the base distance (bits 0-15), extra
+// bits (16-19) and code length (24-27) for the fast loop
+struct DistanceTable
+{
+    Huffman code;
+    uint32_t fast[1 << FAST_BITS];
+
+    bool build(const uint8_t* lengths, int n)
+    {
+        if (!code.build(lengths, n))
+            return false;
+        for (uint32_t i = 0; i < (1 << FAST_BITS); i++) {
+            uint32_t const e = code.entry(i);
+            uint32_t const sym = e >> 4;
+            fast[i] = e && sym < 30 ? (e & 15) << 24 | DIST_EXTRA[sym] << 16 |
+                                          DIST_BASE[sym]
+                                    : 0;
+        }
+        return true;
+    }
+};
+
+struct FixedTables
+{
+    LiteralTable lit;
+    DistanceTable dist;
+    FixedTables()
+    {
+        uint8_t lengths[288];
+        std::fill(lengths, lengths + 144, 8);
+        std::fill(lengths + 144, lengths + 256, 9);
+        std::fill(lengths + 256, lengths + 280, 7);
+        std::fill(lengths + 280, lengths + 288, 8);
+        lit.build(lengths, 288);
+        // 30 and 31 are never valid, but complete the code
+        std::fill(lengths, lengths + 32, 5);
+        dist.build(lengths, 32);
+    }
+};
+
+// Read the header of a dynamic block, following the block type
+bool readDynamic(BitReader& br, LiteralTable& lit, DistanceTable& dist)
+{
+    static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                      11, 4,  12, 3, 13, 2, 14, 1, 15};
+    br.refill();
+    int const nlen = br.get(5) + 257;
+    int const ndist = br.get(5) + 1;
+    int const ncode = br.get(4) + 4;
+    if (nlen > 286 || ndist > 30)
+        return false;
+
+    uint8_t lengths[286 + 30] = {};
+    for (int i = 0; i < ncode; i++) {
+        br.refill();
+        lengths[order[i]] = br.get(3);
+    }
+    Huffman pre;
+    if (!pre.build(lengths, 19, true))
+        return false;
+
+    memset(lengths, 0, 19);
+    int i = 0;
+    while (i < nlen + ndist) {
+        br.refill();
+        int const sym = pre.decode(br);
+        if (sym < 0)
+            return false;
+        if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (sym == 16) {
+            if (i == 0)
+                return false;
+            value = lengths[i - 1];
+            repeat = 3 + br.get(2);
+        } else if (sym == 17) {
+            repeat = 3 + br.get(3);
+        } else {
+            repeat = 11 + br.get(7);
+        }
+        if (i + repeat > nlen + ndist)
+            return false;
+        std::fill(lengths + i, lengths + i + repeat, value);
+        i += repeat;
+    }
+    if (lengths[256] == 0)
+        return false;
+    return lit.build(lengths, nlen) && dist.build(lengths + nlen, ndist);
+}
+
+// Output for a part that starts where the inflated data is known: bytes are
+// written to their final place, and the data before 'pos' is the window.
+struct ByteSink
+{
+    uint8_t* out;
+    size_t size;
+    size_t pos;
+
+    bool literal(int c)
+    {
+        if (pos == size)
+            return false;
+        out[pos++] = c;
+        return true;
+    }
+    bool copy(uint32_t dist, uint32_t len)
+    {
+        if (dist > pos || len > size - pos)
+            return false;
+        uint8_t* dst = out + pos;
+        const uint8_t* src = dst - dist;
+        if (dist >= len) {
+            memcpy(dst, src, len);
+        } else {
+            for (uint32_t i = 0; i < len; i++)
+                dst[i] = src[i];
+        }
+        pos += len;
+        return true;
+    }
+    bool stored(const uint8_t* data, size_t len)
+    {
+        if (len > size - pos)
+            return false;
+        memcpy(out + pos, data, len);
+        pos += len;
+        return true;
+    }
+};
+
+// Decode symbols of the current block straight into 'sink' for as long as
+// there is input and output to spare, so no bounds are checked per symbol
+// and matches are copied in 16 byte pieces. Returns 1 at the end of the
+// block, 0 when the rest must be decoded carefully, -1 on errors.
+int inflateFastSymbols(BitReader& br, const LiteralTable& lit,
+                       const DistanceTable& dist, ByteSink& sink)
+{
+    uint8_t* const out = sink.out;
+    size_t pos = sink.pos;
+    size_t const limit = sink.size > FAST_SLACK ? sink.size - FAST_SLACK : 0;
+    int rc = 0;
+    auto literals = [&](uint32_t e) {
+        br.consume((e >> 24) & 15);
+        out[pos] = e;
+        out[pos + 1] = e >> 8;
+        pos += e >> 30;
+    };
+    while (pos < limit && br.canRefillFast()) {
+        br.refillFast();
+        // Up to three lookups fit in one refill
+        uint32_t e = lit.multi[br.peek(FAST_BITS)];
+        if (e >> 30) {
+            literals(e);
+            e = lit.multi[br.peek(FAST_BITS)];
+            if (e >> 30) {
+                literals(e);
+                e = lit.multi[br.peek(FAST_BITS)];
+                if (e >> 30) {
+                    literals(e);
+                    continue;
+                }
+            }
+            // A length and distance may need 48 bits
+            br.refillFast();
+        }
+
+        uint32_t len;
+        if (e & LiteralTable::LENGTH) {
+            uint32_t const bits = (e >> 24) & 15;
+            uint32_t const extra = (e >> 9) & 15;
+            len = (e & 0x1ff) + (br.peek(bits + extra) >> bits);
+            br.consume(bits + extra);
+        } else if (e & LiteralTable::END) {
+            br.consume((e >> 24) & 15);
+            rc = 1;
+            break;
+        } else {
+            int sym = lit.code.decode(br);
+            if (sym < 256) {
+                if (sym < 0) {
+                    rc = -1;
+                    break;
+                }
+                out[pos++] = sym;
+                continue;
+            }
+            if (sym == 256) {
+                rc = 1;
+                break;
+            }
+            sym -= 257;
+            if (sym >= 29) {
+                rc = -1;
+                break;
+            }
+            len = LEN_BASE[sym] + br.get(LEN_EXTRA[sym]);
+        }
+
+        uint32_t distance;
+        if (uint32_t const de = dist.fast[br.peek(FAST_BITS)]) {
+            uint32_t const bits = de >> 24;
+            uint32_t const extra = (de >> 16) & 15;
+            distance = (de & 0xffff) + (br.peek(bits + extra) >> bits);
+            br.consume(bits + extra);
+        } else {
+            int const d = dist.code.decode(br);
+            if (d < 0 || d >= 30) {
+                rc = -1;
+                break;
+            }
+            distance = DIST_BASE[d] + br.get(DIST_EXTRA[d]);
+        }
+        if (distance > pos) {
+            rc = -1;
+            break;
+        }
+
+        // The copies may write up to 15 bytes past the match, which the
+        // slack allows for and later output overwrites
+        uint8_t* dst = out + pos;
+        const uint8_t* src = dst - distance;
+        pos += len;
+        if (distance >= 16) {
+            for (uint32_t i = 0; i < len; i += 16)
+                memcpy(dst + i, src + i, 16);
+        } else if (distance >= 8) {
+            for (uint32_t i = 0; i < len; i += 8)
+                memcpy(dst + i, src + i, 8);
+        } else if (distance == 1) {
+            memset(dst, *src, len);
+        } else {
+            for (uint32_t i = 0; i < len; i++)
+                dst[i] = src[i];
+        }
+    }
+    sink.pos = pos;
+    return rc;
+}
+
+// Output for a part with an unknown window. Values 0-255 are bytes,
+// 256 + n stands for byte n of the 32KB preceding the part.
+struct MarkerSink
+{
+    std::vector<uint16_t> out;
+    size_t limit;
+    size_t pos = 0;
+    // Set when the output did not fit in 'limit'
+    bool full = false;
+
+    explicit MarkerSink(size_t maxSize) : limit(maxSize) {}
+
+    bool reserve(size_t n)
+    {
+        if (n > limit - pos) {
+            full = true;
+            return false;
+        }
+        if (pos + n > out.size())
+            out.resize(std::min(limit, std::max(out.size() * 2, pos + n + 65536)));
+        return true;
+    }
+    bool literal(int c)
+    {
+        if (!reserve(1))
+            return false;
+        out[pos++] = c;
+        return true;
+    }
+    bool copy(uint32_t dist, uint32_t len)
+    {
+        if (!reserve(len))
+            return false;
+        for (uint32_t i = 0; i < len; i++, pos++) {
+            out[pos] = dist > pos ? 256 + WINDOW_SIZE - (dist - pos)
+                                  : out[pos - dist];
+        }
+        return true;
+    }
+    bool stored(const uint8_t* data, size_t len)
+    {
+        if (!reserve(len))
+            return false;
+        std::copy(data, data + len, out.begin() + pos);
+        pos += len;
+        return true;
+    }
+};
+
+// Inflate blocks until the final one, or until a block ends at or after
+// 'stopBit'.
+template <typename Sink>
+bool inflateBlocks(BitReader& br, Sink& sink, uint64_t stopBit, bool& final)
+{
+    static const FixedTables fixed;
+    LiteralTable dynLit;
+    DistanceTable dynDist;
+    final = false;
+    while (!final && br.bitPos() < stopBit) {
+        br.refill();
+        final = br.get(1) != 0;
+        auto const type = br.get(2);
+        const LiteralTable* lit = &fixed.lit;
+        const DistanceTable* dist = &fixed.dist;
+        if (type == 0) {
+            auto const* head = br.bytes(4);
+            if (!head)
+                return false;
+            uint16_t const len = head[0] | head[1] << 8;
+            uint16_t const nlen = head[2] | head[3] << 8;
+            auto const* data = br.bytes(len);
+            if (len != (uint16_t)~nlen || !data || !sink.stored(data, len))
+                return false;
+            br.refill();
+            continue;
+        }
+        if (type == 2) {
+            if (!readDynamic(br, dynLit, dynDist))
+                return false;
+            lit = &dynLit;
+            dist = &dynDist;
+        } else if (type != 1) {
+            return false;
+        }
+
+        if constexpr (std::is_same_v<Sink, ByteSink>) {
+            int const rc = inflateFastSymbols(br, *lit, *dist, sink);
+            if (rc < 0)
+                return false;
+            if (rc > 0)
+                continue;
+        }
+        while (true) {
+            br.refill();
+            if (br.overrun())
+                return false;
+            int sym = lit->code.decode(br);
+            if (sym < 256) {
+                if (sym < 0 || !sink.literal(sym))
+                    return false;
+                continue;
+            }
+            if (sym == 256)
+                break;
+            sym -= 257;
+            if (sym >= 29)
+                return false;
+            uint32_t const len = LEN_BASE[sym] + br.get(LEN_EXTRA[sym]);
+            int const d = dist->code.decode(br);
+            if (d < 0 || d >= 30)
+                return false;
+            uint32_t const distance = DIST_BASE[d] + br.get(DIST_EXTRA[d]);
+            if (!sink.copy(distance, len))
+                return false;
+        }
+    }
+    return !br.overrun();
+}
+
+// Quick test for a dynamic block header at 'bit', before parsing it fully
+bool maybeDynamic(const uint8_t* in, size_t inSize, uint64_t bit)
+{
+    auto const pos = bit / 8;
+    uint32_t v = 0;
+    for (size_t i = 0; i < 4 && pos + i < inSize; i++)
+        v |= (uint32_t)in[pos + i] << (8 * i);
+    v >>= bit & 7;
+    return ((v >> 1) & 3) == 2 && ((v >> 3) & 31) <= 29 && ((v >> 8) & 31) <= 29;
+}
+
+struct Part
+{
+    uint64_t startBit = 0;
+    uint64_t stopBit = NO_STOP;
+    uint64_t endBit = 0;
+    bool ok = false;
+    bool final = false;
+    std::vector<uint16_t> data;
+    size_t size = 0;
+};
+
+// Find the first plausible block start at or after 'startBit' and inflate
+// from there, into at most 'limit' bytes. Candidates that fail to inflate
+// are skipped; running out of room gives up on the part.
+void inflateGuessed(const uint8_t* in, size_t inSize, size_t limit,
+                    uint64_t startBit, Part& part)
+{
+    LiteralTable lit;
+    DistanceTable dist;
+    for (auto bit = startBit; bit < part.stopBit && bit < inSize * 8; bit++) {
+        if (!maybeDynamic(in, inSize, bit))
+            continue;
+        {
+            BitReader br(in, inSize, bit + 3);
+            if (!readDynamic(br, lit, dist))
+                continue;
+        }
+        MarkerSink sink{limit};
+        BitReader br(in, inSize, bit);
+        if (inflateBlocks(br, sink, part.stopBit, part.final)) {
+            part.ok = true;
+            part.startBit = bit;
+            part.endBit = br.bitPos();
+            part.data = std::move(sink.out);
+            part.size = sink.pos;
+            return;
+        }
+        if (sink.full)
+            return;
+    }
+}
+
+// Continue inflating from 'bit' into known output
+bool inflateKnown(const uint8_t* in, size_t inSize, ByteSink& sink,
+                  uint64_t& bit, uint64_t stopBit, bool& final)
+{
+    BitReader br(in, inSize, bit);
+    bool const ok = inflateBlocks(br, sink, stopBit, final);
+    bit = br.bitPos();
+    return ok;
+}
+
+} // namespace
+
+bool inflateParallel(const uint8_t* in, size_t inSize, uint8_t* out,
+                     size_t outSize, int threadCount)
+{
+    auto const count =
+        std::min<size_t>(std::max(threadCount, 1), inSize / MIN_PART);
+    if (count < 2)
+        return false;
+
+    auto const partSize = inSize / count;
+    auto const partLimit = std::min(outSize, partSize * MAX_PART_RATIO);
+    std::vector<Part> parts(count);
+    for (size_t i = 0; i + 1 < count; i++)
+        parts[i].stopBit = (i + 1) * partSize * 8;
+
+    ByteSink sink{out, outSize, 0};
+    std::vector<std::thread> threads;
+    threads.emplace_back([&] {
+        auto& part = parts[0];
+        part.ok = inflateKnown(in, inSize, sink, part.endBit, part.stopBit,
+                               part.final);
+    });
+    for (size_t i = 1; i < count; i++) {
+        threads.emplace_back([&, i] {
+            inflateGuessed(in, inSize, partLimit, i * partSize * 8, parts[i]);
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    if (!parts[0].ok)
+        return false;
+    uint64_t bit = parts[0].endBit;
+    bool final = parts[0].final;
+    for (size_t i = 1; i < count && !final; i++) {
+        auto& part = parts[i];
+        // A bad guess is caught here, as the previous part can not end
+        // exactly where it starts
+        if (part.ok && part.startBit > bit &&
+            !inflateKnown(in, inSize, sink, bit, part.startBit, final))
+            return false;
+        if (final)
+            break;
+        if (!part.ok || part.startBit != bit) {
+            if (!inflateKnown(in, inSize, sink, bit, part.stopBit, final))
+                return false;
+            continue;
+        }
+
+        if (part.size > outSize - sink.pos)
+            return false;
+        auto const pos = sink.pos;
+        for (size_t j = 0; j < part.size; j++) {
+            size_t const v = part.data[j];
+            if (v < 256) {
+                out[pos + j] = v;
+                continue;
+            }
+            if (v - 256 + pos < WINDOW_SIZE)
+                return false;
+            out[pos + j] = out[pos + v - 256 - WINDOW_SIZE];
+        }
+        sink.pos += part.size;
+        bit = part.endBit;
+        final = part.final;
+        std::vector<uint16_t>().swap(part.data);
+    }
+    return final && sink.pos == outSize;
+}
+
+bool inflateFast(const uint8_t* in, size_t inSize, uint8_t* out,
+                 size_t outSize)
+{
+    ByteSink sink{out, outSize, 0};
+    uint64_t bit = 0;
+    bool final = false;
+    return inflateKnown(in, inSize, sink, bit, NO_STOP, final) && final &&
+           sink.pos == outSize;
+}
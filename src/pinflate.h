@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Inflate a whole raw deflate stream into 'out', which must hold exactly
+// the uncompressed size. Uses 64 bit bit buffers, a table that decodes two
+// literals per lookup and wide match copies; about twice as fast as
+// mz_inflate() on source code and text. Returns false if the data is not a
+// valid deflate stream of that size.
+bool inflateFast(const uint8_t* in, size_t inSize, uint8_t* out,
+                 size_t outSize);
+
+// Inflate a raw deflate stream with several threads, without an index.
+//
+// The compressed data is cut into one part per thread. Every part but the
+// first guesses where its first deflate block starts by looking for a
+// dynamic block header that builds valid Huffman codes, and is inflated
+// from there with back references into the unknown preceding 32KB kept as
+// markers. The parts are then joined in order: a part is used if the part
+// before it really ended where it guessed it would start, and its markers
+// are replaced with the now known window. Otherwise the stretch is
+// inflated again from where the previous part ended, as it is for parts
+// that would inflate to more than a few times their compressed size.
+//
+// 'out' must hold exactly the uncompressed size. Returns false if the data
+// is not a valid deflate stream of that size, or too small to split; the
+// caller should fall back to mz_inflate().
+bool inflateParallel(const uint8_t* in, size_t inSize, uint8_t* out,
+                     size_t outSize, int threadCount);
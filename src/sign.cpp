@@ -3,10 +3,13 @@
 #include "crypto.h"
 #include "ziparchive.h"
 
+#include <algorithm>
+
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <openssl/sha.h>
 
 const static int SHA_LEN = 20;
 uint32_t crc32_fast(const void* data, size_t length,
@@ -15,7 +18,27 @@ uint32_t crc32_fast(const void* data, size_t length,
 using namespace std;
 using namespace asn1;
 
-void sign(ZipArchive& zipArchive, KeyStore& keyStore, const string& digestFile)
+// The current key of the keystore. Caller frees it.
+static RSA* readKey(KeyStore& keyStore)
+{
+    vector<uint8_t> key;
+    try {
+        key = keyStore.getKey();
+    } catch (key_exception& ke) {
+        throw sign_exception(ke);
+    }
+
+    string pemKey = toPem(key);
+    BIO* bio = BIO_new_mem_buf((void*)pemKey.c_str(), -1);
+    RSA* rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
+    BIO_free_all(bio);
+    if (rsa == nullptr)
+        throw sign_exception("Could not read valid RSA key");
+    return rsa;
+}
+
+void sign(ZipArchive& zipArchive, KeyStore& keyStore, const string& digestFile,
+          int scheme)
 {
     SHA_CTX context;
     string head = "Manifest-Version: 1.0\015\012Created-By: 1.0 "
@@ -32,36 +55,33 @@ void sign(ZipArchive& zipArchive, KeyStore& keyStore, const string& digestFile)
                        manifestMF.length(), 0, checksum);
     zipArchive.write((uint8_t*)manifestMF.c_str(), manifestMF.length());
 
-    unsigned char sha[SHA_LEN];
-
     vector<char> digestCopy(digestFile.length() + 1);
     strcpy(&digestCopy[0], digestFile.c_str());
 
+    // Each section ends with an empty line and gets its own digest, patched
+    // into the last 32 bytes of the section ("SHA1-Digest: <28 bytes>\r\n")
+    unsigned char sha[SHA_LEN];
     char* digestPtr = &digestCopy[0];
     while (true) {
-        char* ptr = digestPtr;
-
-        while (*ptr) {
-            if (ptr[0] == 0x0d && ptr[1] == 0xa && ptr[2] == 0x0d &&
-                ptr[3] == 0x0a)
-                break;
-            ptr++;
-        }
-
-        if (!*ptr)
+        char* ptr = strstr(digestPtr, "\015\012\015\012");
+        if (!ptr)
             break;
-
         ptr += 4;
-
         SHA1_Init(&context);
         SHA1_Update(&context, digestPtr, ptr - digestPtr);
         SHA1_Final(sha, &context);
         memcpy(ptr - 32, base64_encode(sha, SHA_LEN).c_str(), 28);
-
         digestPtr = ptr;
     }
-    const string sigHead = "Signature-Version: 1.0\015\012Created-By: 1.0 "
-                           "(Fastzip)\015\012SHA1-Digest-Manifest: ";
+
+    string sigHead = "Signature-Version: 1.0\015\012Created-By: 1.0 "
+                     "(Fastzip)\015\012";
+    // Tells verifiers to reject the APK if the newer signatures are stripped
+    if (scheme == 2)
+        sigHead += "X-Android-APK-Signed: 2\015\012";
+    else if (scheme >= 3)
+        sigHead += "X-Android-APK-Signed: 2, 3\015\012";
+    sigHead += "SHA1-Digest-Manifest: ";
 
     string certSF = sigHead + base64_encode(manifestSha, SHA_LEN) +
                     "\015\012\015\012" + string(&digestCopy[0]);
@@ -78,18 +98,7 @@ void sign(ZipArchive& zipArchive, KeyStore& keyStore, const string& digestFile)
     SHA1_Update(&context, certSF.c_str(), certSF.size());
     SHA1_Final(digest, &context);
 
-    vector<uint8_t> key;
-    try {
-        key = keyStore.getKey();
-    } catch (key_exception& ke) {
-        throw sign_exception(ke);
-    }
-
-    string pemKey = toPem(key);
-    BIO* bio = BIO_new_mem_buf((void*)pemKey.c_str(), -1);
-    RSA* rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, NULL, NULL);
-    if (rsa == nullptr)
-        throw sign_exception("Could not read valid RSA key");
+    RSA* rsa = readKey(keyStore);
 
     vector<uint8_t> certificate = keyStore.getCert();
 
@@ -118,8 +127,6 @@ void sign(ZipArchive& zipArchive, KeyStore& keyStore, const string& digestFile)
 
     RSA_free(rsa);
 
-    BIO_free_all(bio);
-
     sign.resize(signLen);
     // clang-format off
     auto data =
@@ -169,3 +176,279 @@ void sign(ZipArchive& zipArchive, KeyStore& keyStore, const string& digestFile)
     zipArchive.addFile("META-INF/CERT.RSA", true, data.size(), data.size(), 0, checksum);
     zipArchive.write(&data[0], data.size());
 }
+
+// Values in the signing block are little endian, and most are prefixed with
+// their 32 bit length
+static void put32(vector<uint8_t>& v, uint32_t x)
+{
+    for (int i = 0; i < 4; i++)
+        v.push_back(x >> (i * 8));
+}
+
+static void put64(vector<uint8_t>& v, uint64_t x)
+{
+    for (int i = 0; i < 8; i++)
+        v.push_back(x >> (i * 8));
+}
+
+static void putBytes(vector<uint8_t>& v, const vector<uint8_t>& data)
+{
+    put32(v, data.size());
+    v.insert(v.end(), data.begin(), data.end());
+}
+
+// One signer of the v2 or v3 block
+static vector<uint8_t> makeSigner(RSA* rsa, const vector<uint8_t>& certificate,
+                                  const vector<uint8_t>& publicKey,
+                                  const ContentDigest::Digest& contentDigest,
+                                  int version, bool strippingProtection)
+{
+    const uint32_t RSA_PKCS1_SHA256 = 0x0103;
+    const uint32_t MIN_SDK = 28; // Android P, the first to read v3
+    const uint32_t MAX_SDK = 0x7fffffff;
+
+    vector<uint8_t> digest;
+    put32(digest, RSA_PKCS1_SHA256);
+    putBytes(digest, {contentDigest.begin(), contentDigest.end()});
+    vector<uint8_t> digests;
+    putBytes(digests, digest);
+
+    vector<uint8_t> certificates;
+    putBytes(certificates, certificate);
+
+    // Tells a v2 verifier that the v3 block must be there too
+    vector<uint8_t> attributes;
+    if (strippingProtection) {
+        vector<uint8_t> attribute;
+        put32(attribute, 0xbeeff00d);
+        put32(attribute, 3);
+        putBytes(attributes, attribute);
+    }
+
+    vector<uint8_t> signedData;
+    putBytes(signedData, digests);
+    putBytes(signedData, certificates);
+    if (version == 3) {
+        put32(signedData, MIN_SDK);
+        put32(signedData, MAX_SDK);
+    }
+    putBytes(signedData, attributes);
+
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256(signedData.data(), signedData.size(), hash);
+    vector<uint8_t> sign(RSA_size(rsa));
+    unsigned int signLen;
+    if (RSA_sign(NID_sha256, hash, sizeof(hash), sign.data(), &signLen,
+                 rsa) != 1)
+        throw sign_exception("Could not sign APK");
+    sign.resize(signLen);
+
+    vector<uint8_t> signature;
+    put32(signature, RSA_PKCS1_SHA256);
+    putBytes(signature, sign);
+    vector<uint8_t> signatures;
+    putBytes(signatures, signature);
+
+    vector<uint8_t> signer;
+    putBytes(signer, signedData);
+    if (version == 3) {
+        put32(signer, MIN_SDK);
+        put32(signer, MAX_SDK);
+    }
+    putBytes(signer, signatures);
+    putBytes(signer, publicKey);
+
+    vector<uint8_t> signers;
+    putBytes(signers, signer);
+    vector<uint8_t> value;
+    putBytes(value, signers);
+    return value;
+}
+
+vector<uint8_t> apkSigningBlock(KeyStore& keyStore,
+                                const ContentDigest::Digest& digest,
+                                int scheme)
+{
+    const uint32_t V2_BLOCK_ID = 0x7109871a;
+    const uint32_t V3_BLOCK_ID = 0xf05368c0;
+
+    RSA* rsa = readKey(keyStore);
+    vector<uint8_t> publicKey(i2d_RSA_PUBKEY(rsa, nullptr));
+    uint8_t* ptr = publicKey.data();
+    i2d_RSA_PUBKEY(rsa, &ptr);
+
+    vector<pair<uint32_t, vector<uint8_t>>> values;
+    try {
+        const auto certificate = keyStore.getCert();
+        values.emplace_back(V2_BLOCK_ID,
+                            makeSigner(rsa, certificate, publicKey, digest, 2,
+                                       scheme >= 3));
+        if (scheme >= 3)
+            values.emplace_back(V3_BLOCK_ID,
+                                makeSigner(rsa, certificate, publicKey,
+                                           digest, 3, false));
+    } catch (sign_exception&) {
+        RSA_free(rsa);
+        throw;
+    }
+    RSA_free(rsa);
+
+    // size, (id, value) pairs, size again, magic
+    vector<uint8_t> pairs;
+    for (auto const& [id, value] : values) {
+        put64(pairs, value.size() + 4);
+        put32(pairs, id);
+        pairs.insert(pairs.end(), value.begin(), value.end());
+    }
+    const char magic[] = "APK Sig Block 42";
+    const uint64_t size = pairs.size() + 8 + 16;
+
+    vector<uint8_t> block;
+    put64(block, size);
+    block.insert(block.end(), pairs.begin(), pairs.end());
+    put64(block, size);
+    block.insert(block.end(), magic, magic + 16);
+    return block;
+}
+
+// Walks the length prefixed values of a signing block
+class BlockReader
+{
+public:
+    BlockReader(const uint8_t* data, size_t size) : ptr(data), end(data + size)
+    {}
+
+    bool atEnd() const { return ptr == end; }
+
+    uint32_t u32()
+    {
+        need(4);
+        uint32_t x = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) |
+                     ((uint32_t)ptr[3] << 24);
+        ptr += 4;
+        return x;
+    }
+
+    BlockReader bytes()
+    {
+        const uint32_t size = u32();
+        need(size);
+        BlockReader r{ptr, size};
+        ptr += size;
+        return r;
+    }
+
+    vector<uint8_t> vec() const { return {ptr, end}; }
+
+private:
+    void need(size_t size)
+    {
+        if ((size_t)(end - ptr) < size)
+            throw sign_exception("Truncated APK Signing Block");
+    }
+
+    const uint8_t* ptr;
+    const uint8_t* end;
+};
+
+// Check every signer of a v2 or v3 block against the content digest
+static void verifySigners(BlockReader signers,
+                          const ContentDigest::Digest& contentDigest,
+                          int version)
+{
+    const uint32_t RSA_PKCS1_SHA256 = 0x0103;
+    int count = 0;
+    while (!signers.atEnd()) {
+        auto signer = signers.bytes();
+        auto signedData = signer.bytes();
+        if (version == 3) {
+            signer.u32();
+            signer.u32();
+        }
+        auto signatures = signer.bytes();
+        const auto publicKey = signer.bytes().vec();
+
+        bool digestFound = false;
+        auto data = signedData;
+        auto digests = data.bytes();
+        while (!digests.atEnd()) {
+            auto digest = digests.bytes();
+            if (digest.u32() != RSA_PKCS1_SHA256)
+                continue;
+            const auto value = digest.bytes().vec();
+            if (value.size() != contentDigest.size() ||
+                memcmp(value.data(), contentDigest.data(), value.size()) != 0)
+                throw sign_exception("APK content digest does not match");
+            digestFound = true;
+        }
+        if (!digestFound)
+            throw sign_exception("Unsupported APK signature algorithm");
+
+        const uint8_t* keyPtr = publicKey.data();
+        RSA* rsa = d2i_RSA_PUBKEY(nullptr, &keyPtr, publicKey.size());
+        if (!rsa)
+            throw sign_exception("Could not read APK signer public key");
+        const auto signedBytes = signedData.vec();
+        uint8_t hash[SHA256_DIGEST_LENGTH];
+        SHA256(signedBytes.data(), signedBytes.size(), hash);
+        int checked = 0;
+        int verified = 0;
+        while (!signatures.atEnd()) {
+            auto signature = signatures.bytes();
+            if (signature.u32() != RSA_PKCS1_SHA256)
+                continue;
+            const auto sign = signature.bytes().vec();
+            checked++;
+            verified += RSA_verify(NID_sha256, hash, sizeof(hash), sign.data(),
+                                   sign.size(), rsa) == 1;
+        }
+        RSA_free(rsa);
+        if (checked == 0 || verified != checked)
+            throw sign_exception("APK signature does not verify");
+        count++;
+    }
+    if (count == 0)
+        throw sign_exception("APK signature block has no signers");
+}
+
+int verifyApk(const string& zipName, int threadCount,
+              ContentDigest::Stats* stats)
+{
+    const uint32_t V2_BLOCK_ID = 0x7109871a;
+    const uint32_t V3_BLOCK_ID = 0xf05368c0;
+
+    vector<uint8_t> block;
+    ContentDigest::Digest digest;
+    try {
+        digest =
+            ContentDigest::ofArchive(zipName, threadCount, &block, stats);
+    } catch (io_exception&) {
+        throw sign_exception("Could not read archive");
+    }
+    if (block.empty())
+        return 1;
+
+    // size, (id, value) pairs, size again, magic
+    int scheme = 0;
+    const uint8_t* ptr = block.data() + 8;
+    const uint8_t* end = block.data() + block.size() - 24;
+    while (ptr < end) {
+        uint64_t size = 0;
+        if ((uint64_t)(end - ptr) >= 8)
+            memcpy(&size, ptr, 8);
+        if ((uint64_t)(end - ptr) < 12 || size < 4 ||
+            size > (uint64_t)(end - ptr) - 8)
+            throw sign_exception("Truncated APK Signing Block");
+        BlockReader pair{ptr + 8, size};
+        ptr += 8 + size;
+        const uint32_t id = pair.u32();
+        if (id == V2_BLOCK_ID || id == V3_BLOCK_ID) {
+            const int version = id == V2_BLOCK_ID ? 2 : 3;
+            verifySigners(pair.bytes(), digest, version);
+            scheme = std::max(scheme, version);
+        }
+    }
+    if (scheme == 0)
+        throw sign_exception("APK Signing Block has no v2 or v3 signature");
+    return scheme;
+}
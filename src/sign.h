@@ -1,6 +1,9 @@
 #pragma once
 
+#include "contentdigest.h"
+
 #include <string>
+#include <vector>
 
 class ZipArchive;
 class KeyStore;
@@ -16,5 +19,20 @@ private:
     const char* msg;
 };
 
+// Jar sign the archive. 'scheme' is the highest APK signature scheme that
+// will also be added; the signature file says so, to protect against
+// stripping.
 void sign(ZipArchive& zipArchive, KeyStore& keyStore,
-          const std::string& digestFile);
+          const std::string& digestFile, int scheme = 1);
+
+// APK Signing Block with APK Signature Scheme v2 (and v3 if 'scheme' is 3)
+// signatures over the given content digest
+std::vector<uint8_t> apkSigningBlock(KeyStore& keyStore,
+                                     const ContentDigest::Digest& digest,
+                                     int scheme);
+
+// Check the APK Signature Scheme v2/v3 signatures of an archive, hashing it
+// using 'threadCount' threads. Returns the highest scheme that verified, or
+// 1 if there is no signing block. Throws sign_exception on failure.
+int verifyApk(const std::string& zipName, int threadCount,
+              ContentDigest::Stats* stats = nullptr);
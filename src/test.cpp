@@ -1,16 +1,30 @@
 #include "catch.hpp"
 
+#include <chrono>
 #include <cstdlib>
+#include <functional>
+#include <mutex>
 #include <string>
 
+#include <openssl/sha.h>
+
 #include "fastzip.h"
 #include "funzip.h"
+#include "inflate.h"
+#include "pinflate.h"
+#include "sign.h"
 #include "utils.h"
+#include "ziparchive.h"
+#include "zipformat.h"
+#include "zipstream.h"
 
 #include "file.h"
 
 #ifdef _WIN32
 #    include <io.h>
+#else
+#    include <csignal>
+#    include <sys/resource.h>
 #endif
 
 enum
@@ -35,7 +49,7 @@ std::vector<std::string> createFiles(const std::string& templ, int count,
     std::vector<std::string> files(count);
     for (auto& f : files) {
         auto name = makeTemp(templ);
-        auto file = File{name};
+        auto file = File{name, File::WRITE};
         int sz = (rand() % (maxSize - minSize)) + minSize;
         auto data = std::make_unique<uint8_t[]>(sz);
         if ((flags & EMPTY) == 0) {
@@ -87,11 +101,37 @@ bool compareDir(const std::string& a, const std::string& b)
     return ok;
 }
 
+// Seconds taken by the fastest of a few runs of 'f', to keep noise out of
+// benchmarks
+double bestTime(const std::function<void()>& f)
+{
+    using Clock = std::chrono::steady_clock;
+    double result = 1e9;
+    for (int i = 0; i < 3; i++) {
+        auto const start = Clock::now();
+        f();
+        std::chrono::duration<double> const elapsed = Clock::now() - start;
+        result = std::min(result, elapsed.count());
+    }
+    return result;
+}
+
 enum
 {
     FORCE64 = 1,
     SEQ = 2,
-    SIGN = 4
+    SIGN = 4,
+    SPLIT = 8,
+    STREAM = 16,
+    WRITER = 32,
+    LARGEST = 64,
+    MMAP = 128,
+    APK_SIGN = 256,
+    BASE = 512,
+    CACHE = 1024,
+    UPDATE = 2048,
+    COMPACT = 4096,
+    INDEX = 8192
 };
 
 void zipUnzip(const std::string& dirName, const std::string& zipName,
@@ -108,6 +148,38 @@ void zipUnzip(const std::string& dirName, const std::string& zipName,
         fs.keyPassword = "fastzip";
         fs.doSign = true;
     }
+    if (flags & SPLIT) {
+        fs.threadCount = 4;
+        fs.splitSize = 1024 * 1024;
+        fs.chunkSize = 256 * 1024;
+    }
+    if (flags & STREAM)
+        fs.memoryBudget = 256 * 1024;
+    if (flags & WRITER) {
+        fs.threadCount = 4;
+        fs.writeQueueSize = 64 * 1024;
+    }
+    if (flags & LARGEST) {
+        fs.threadCount = 4;
+        fs.schedule = Fastzip::LARGEST_FIRST;
+    }
+    if (flags & MMAP)
+        fs.mapInput = true;
+    if (flags & APK_SIGN) {
+        fs.keyPassword = "fastzip";
+        fs.doSign = true;
+        fs.signScheme = 3;
+    }
+    if (flags & BASE)
+        fs.baseZip = "temp/base.zip";
+    if (flags & CACHE)
+        fs.cacheDir = "temp/cache";
+    if (flags & UPDATE)
+        fs.update = true;
+    if (flags & COMPACT)
+        fs.compact = true;
+    if (flags & INDEX)
+        fs.indexChunks = true;
 
     fs.addDir(dirName, PackFormat::ZIP5_COMPRESSED);
     fs.zipfile = zipName;
@@ -118,6 +190,20 @@ void zipUnzip(const std::string& dirName, const std::string& zipName,
     fu.exec();
 }
 
+// True if an APK Signing Block sits right in front of the central directory
+bool hasSigningBlock(const std::string& zipName)
+{
+    File f{zipName};
+    f.seek(-22, File::End);
+    auto const eocd = f.Read<std::array<uint8_t, 22>>();
+    uint32_t startCD;
+    memcpy(&startCD, &eocd[16], 4);
+    std::array<char, 16> magic;
+    f.seek(startCD - 16);
+    f.Read(magic);
+    return memcmp(magic.data(), "APK Sig Block 42", 16) == 0;
+}
+
 TEST_CASE("file", "")
 {
     File f{"README.md"};
@@ -130,6 +216,47 @@ TEST_CASE("file", "")
     for (const auto& line : f.lines()) {
         puts(line.c_str());
     }
+
+#ifndef _WIN32
+    // Maps ranges of any size, at any offset
+    auto map = FileMap::mapOnly(f, 10, 20);
+    REQUIRE(map);
+    REQUIRE(map->isMapped());
+    std::array<uint8_t, 20> expected;
+    REQUIRE(f.readAt(expected.data(), expected.size(), 10) == expected.size());
+    REQUIRE(memcmp(map->data(), expected.data(), expected.size()) == 0);
+#endif
+}
+
+TEST_CASE("output map", "")
+{
+    makedirs("temp");
+    for (size_t size : {100, 256 * 1024}) {
+        std::vector<uint8_t> expected(size);
+        for (size_t i = 0; i < size; i++)
+            expected[i] = i * 7;
+        {
+            File f{"temp/map.bin", File::CREATE};
+            OutputMap out{f, size};
+            if (size < FileMap::MIN_MAP_SIZE)
+                REQUIRE(!out.isMapped());
+            memcpy(out.data(), expected.data(), size);
+            REQUIRE(out.commit());
+        }
+        REQUIRE(fs::file_size("temp/map.bin") == size);
+        File f{"temp/map.bin"};
+        std::vector<uint8_t> data(size);
+        REQUIRE(f.Read(data.data(), size) == size);
+        REQUIRE(data == expected);
+    }
+
+    // Can't be mapped (no space can be reserved in a read only file), and
+    // too big to buffer
+    File f{"temp/map.bin"};
+    OutputMap out{f, OutputMap::MAX_BUFFER_SIZE + 1};
+    REQUIRE(!out.isMapped());
+    REQUIRE(out.data() == nullptr);
+    REQUIRE(!out.commit());
 }
 
 TEST_CASE("basic", "")
@@ -155,10 +282,386 @@ TEST_CASE("basic", "")
         zipUnzip("temp/zipme", "temp/test.zip", "temp/out", SIGN);
         REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
     }
+    SECTION("Create zip from writer thread")
+    {
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", WRITER | SEQ);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+    }
+    SECTION("Create signed zip from mapped files")
+    {
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", MMAP | SIGN);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+    }
+    SECTION("Reuse unchanged entries from a base zip")
+    {
+        zipUnzip("temp/zipme", "temp/base.zip", "temp/out");
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", BASE);
+        REQUIRE(compareFile("temp/base.zip", "temp/test.zip") == true);
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", BASE | SIGN);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+    }
+    SECTION("Reuse compressed data from the cache")
+    {
+        removeFiles("temp/cache");
+        zipUnzip("temp/zipme", "temp/base.zip", "temp/out");
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", CACHE);
+        REQUIRE(compareFile("temp/base.zip", "temp/test.zip") == true);
+        int files = 0;
+        int cached = 0;
+        for (auto const& e : fs::recursive_directory_iterator("temp/zipme"))
+            files += fs::is_regular_file(e.status());
+        for (auto const& e : fs::directory_iterator("temp/cache"))
+            cached += fs::is_regular_file(e.status());
+        REQUIRE(cached == files);
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", CACHE);
+        REQUIRE(compareFile("temp/base.zip", "temp/test.zip") == true);
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", CACHE | SIGN);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+    }
+    SECTION("Copy entries from another zip")
+    {
+        zipUnzip("temp/zipme", "temp/base.zip", "temp/out");
+        removeFiles("temp/out");
+        Fastzip fs;
+        fs.addZip("temp/base.zip", PackFormat::ZIP5_COMPRESSED);
+        fs.zipfile = "temp/test.zip";
+        fs.exec();
+        FUnzip fu;
+        fu.zipName = "temp/test.zip";
+        fu.destinationDir = "temp/out";
+        fu.exec();
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+    }
+    SECTION("Sign with digests from added zips")
+    {
+        zipUnzip("temp/zipme", "temp/base.zip", "temp/out", SIGN);
+        const std::string manifest = "temp/out/META-INF/MANIFEST.MF";
+        fs::copy_file(manifest, "temp/manifest.mf",
+                      fs::copy_options::overwrite_existing);
+        for (bool index : {false, true}) {
+            if (index) {
+                Fastzip fs;
+                fs.junkPaths = true;
+                fs.writeDigests = true;
+                fs.addDir("temp/zipme", PackFormat::ZIP5_COMPRESSED);
+                fs.zipfile = "temp/base.zip";
+                fs.exec();
+            }
+            removeFiles("temp/out");
+            Fastzip fs;
+            fs.doSign = true;
+            fs.readDigests = index;
+            fs.keyPassword = "fastzip";
+            fs.addZip("temp/base.zip", PackFormat::ZIP5_COMPRESSED);
+            fs.zipfile = "temp/test.zip";
+            fs.exec();
+            FUnzip fu;
+            fu.zipName = "temp/test.zip";
+            fu.destinationDir = "temp/out";
+            fu.exec();
+            REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+            REQUIRE(compareFile("temp/manifest.mf", manifest) == true);
+        }
+
+        // A digest index is only read when asked to
+        std::string wrong;
+        for (auto const& line : File{"temp/base.zip.digests"}.lines()) {
+            auto parts = split(line, " ", 3);
+            if (parts.size() == 4)
+                wrong += parts[0] + " " + parts[1] +
+                         " AAAAAAAAAAAAAAAAAAAAAAAAAAA= " + parts[3] + "\n";
+        }
+        File{"temp/base.zip.digests", File::WRITE}.Write(wrong.data(),
+                                                     wrong.size());
+        removeFiles("temp/out");
+        Fastzip fs;
+        fs.doSign = true;
+        fs.keyPassword = "fastzip";
+        fs.addZip("temp/base.zip", PackFormat::ZIP5_COMPRESSED);
+        fs.zipfile = "temp/test.zip";
+        fs.exec();
+        FUnzip fu;
+        fu.zipName = "temp/test.zip";
+        fu.destinationDir = "temp/out";
+        fu.exec();
+        REQUIRE(compareFile("temp/manifest.mf", manifest) == true);
+        fs::remove("temp/base.zip.digests");
+    }
+    SECTION("Update zip in place")
+    {
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out");
+        auto const size = fs::file_size("temp/test.zip");
+        // Every entry is replaced, and fits where the old one was
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", UPDATE);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+        REQUIRE(fs::file_size("temp/test.zip") == size);
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", UPDATE | COMPACT);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+        REQUIRE(fs::file_size("temp/test.zip") == size);
+    }
+#ifndef _WIN32
+    SECTION("Fail an update that can not be written")
+    {
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out");
+        if (!fileExists("temp/zipmore"))
+            createFiles("temp/zipmore/f", 4, 128 * 1024, 64 * 1024);
+        Fastzip fs;
+        fs.update = true;
+        fs.addDir("temp/zipmore", PackFormat::ZIP5_COMPRESSED);
+        fs.zipfile = "temp/test.zip";
+
+        // The archive can not grow, so the added entries can't be written
+        rlimit old;
+        getrlimit(RLIMIT_FSIZE, &old);
+        rlimit limit = old;
+        limit.rlim_cur = fs::file_size("temp/test.zip");
+        auto const handler = signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        bool failed = false;
+        try {
+            fs.exec();
+        } catch (zip_exception&) {
+            failed = true;
+        }
+        setrlimit(RLIMIT_FSIZE, &old);
+        signal(SIGXFSZ, handler);
+        REQUIRE(failed);
+    }
+#endif
+    SECTION("Create v2/v3 signed zip")
+    {
+        zipUnzip("temp/zipme", "temp/test.zip", "temp/out", APK_SIGN);
+        REQUIRE(compareDir("temp/zipme", "temp/out/zipme") == true);
+        REQUIRE(hasSigningBlock("temp/test.zip"));
+    }
     // TODO: Seq, Sign, Intel, Uncompressed, include zip
     //
     // BIG TEST
 }
+
+TEST_CASE("split", "")
+{
+    removeFiles("temp/out");
+    if (!fileExists("temp/zipsplit")) {
+        createFiles("temp/zipsplit/f", 2, 3 * 1024 * 1024, 2 * 1024 * 1024);
+        createFiles("temp/zipsplit/z", 2, 3 * 1024 * 1024, 2 * 1024 * 1024,
+                    EMPTY);
+    }
+
+    SECTION("Create zip with split files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out", SPLIT);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+    }
+    SECTION("Create signed zip with split files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out", SPLIT | SIGN);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+    }
+    SECTION("Extract split files in parallel from an index")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out", SPLIT | INDEX);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+        ZipStream zs{"temp/test.zip"};
+        int indexed = 0;
+        for (auto const& e : zs)
+            indexed += e.accessPoints.empty() ? 0 : 1;
+        REQUIRE(indexed > 0);
+    }
+    SECTION("Create signed zip with split mapped files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out",
+                 SPLIT | SIGN | MMAP);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+    }
+    SECTION("Create signed zip with streamed files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out", STREAM | SIGN);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+    }
+    SECTION("Create zip64 with streamed files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out",
+                 STREAM | FORCE64);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+    }
+    SECTION("Create signed zip with writer thread and streamed files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out",
+                 WRITER | STREAM | SIGN);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+    }
+    SECTION("Create v2/v3 signed zip with split and streamed files")
+    {
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out",
+                 APK_SIGN | SPLIT | STREAM);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+        ContentDigest::Stats stats;
+        REQUIRE(verifyApk("temp/test.zip", 4, &stats) == 3);
+        REQUIRE(stats.chunks > 4);
+
+        // Any change to the entries must be caught
+        fs::copy_file("temp/test.zip", "temp/test2.zip",
+                      fs::copy_options::overwrite_existing);
+        FILE* fp = fopen("temp/test2.zip", "r+b");
+        fseek(fp, 3 * 1024 * 1024 + 5, SEEK_SET);
+        const int c = fgetc(fp);
+        fseek(fp, 3 * 1024 * 1024 + 5, SEEK_SET);
+        fputc(c ^ 1, fp);
+        fclose(fp);
+        REQUIRE_THROWS_AS(verifyApk("temp/test2.zip", 2), sign_exception&);
+    }
+    SECTION("Largest first keeps sequential order")
+    {
+        if (!fileExists("temp/zipsplit/small"))
+            createFiles("temp/zipsplit/small/s", 20, 64 * 1024);
+        zipUnzip("temp/zipsplit", "temp/test.zip", "temp/out", SPLIT | SEQ);
+        zipUnzip("temp/zipsplit", "temp/test2.zip", "temp/out",
+                 LARGEST | SPLIT | SEQ | STREAM);
+        REQUIRE(compareDir("temp/zipsplit", "temp/out/zipsplit") == true);
+        zipUnzip("temp/zipsplit", "temp/test3.zip", "temp/out",
+                 LARGEST | SPLIT | SEQ);
+        REQUIRE(compareFile("temp/test.zip", "temp/test3.zip") == true);
+    }
+}
+
+TEST_CASE("parallel inflate", "")
+{
+    removeFiles("temp/out");
+    // Text like data, so the deflate stream has many dynamic blocks
+    if (!fileExists("temp/ziptext")) {
+        std::vector<std::string> words(2000);
+        for (auto& w : words)
+            w = makeTemp("").substr(0, 2 + rand() % 7);
+        std::string text;
+        while (text.size() < 6 * 1024 * 1024)
+            text += words[rand() % words.size()] + (rand() % 12 ? " " : "\n");
+        makedirs("temp/ziptext");
+        File{"temp/ziptext/text.txt", File::WRITE}.Write(text.data(),
+                                                          text.size());
+    }
+    Fastzip fs;
+    fs.junkPaths = true;
+    fs.addDir("temp/ziptext", PackFormat::ZIP5_COMPRESSED);
+    fs.zipfile = "temp/test.zip";
+    fs.exec();
+
+    ZipStream zs{"temp/test.zip"};
+    REQUIRE(zs.size() > 0);
+    File f{"temp/test.zip"};
+    for (auto const& e : zs) {
+        if (e.name.back() == '/')
+            continue;
+        f.seek(e.offset);
+        auto const le = f.Read<LocalEntry>();
+        f.seek(le.nameLen + le.exLen, File::Cur);
+        REQUIRE(le.method == 8);
+        std::vector<uint8_t> in(le.compSize);
+        REQUIRE(f.Read(in.data(), in.size()) == in.size());
+        std::vector<uint8_t> out(le.uncompSize);
+        REQUIRE(inflateParallel(in.data(), in.size(), out.data(), out.size(),
+                                4));
+        File text{"temp/ziptext/text.txt"};
+        std::vector<uint8_t> expected(out.size());
+        text.Read(expected.data(), expected.size());
+        REQUIRE(out == expected);
+        // The size must match exactly
+        REQUIRE(!inflateParallel(in.data(), in.size(), out.data(),
+                                 out.size() - 1, 4));
+    }
+
+    FUnzip fu;
+    fu.zipName = "temp/test.zip";
+    fu.destinationDir = "temp/out";
+    fu.threadCount = 4;
+    fu.speculateSize = 1024 * 1024;
+    fu.exec();
+    REQUIRE(compareDir("temp/ziptext", "temp/out/ziptext") == true);
+
+    for (auto inflater : {FUnzip::FAST, FUnzip::MINIZ}) {
+        removeFiles("temp/out");
+        FUnzip single;
+        single.zipName = "temp/test.zip";
+        single.destinationDir = "temp/out";
+        single.speculateSize = 0;
+        single.inflater = inflater;
+        single.exec();
+        REQUIRE(compareDir("temp/ziptext", "temp/out/ziptext") == true);
+    }
+}
+TEST_CASE("copy entry data", "")
+{
+    makedirs("temp");
+    File{"temp/source.bin", File::WRITE}.Write("0123456789", 10);
+    ZipArchive zip{"temp/copy.zip"};
+    ZipEntry entry{};
+    entry.name = "copied";
+    entry.copyFrom = "temp/source.bin";
+    entry.copyOffset = 2;
+    // More than the source has
+    entry.dataSize = entry.originalSize = 100;
+    zip.add(entry);
+    bool failed = false;
+    try {
+        zip.close();
+    } catch (zip_exception&) {
+        failed = true;
+    }
+    REQUIRE(failed);
+}
+
+TEST_CASE("partial zip64 extra", "")
+{
+    // Only the uncompressed size overflows, so the zip64 extra field holds
+    // just that one value
+    const std::string name = "a.txt";
+    const std::string data = "hello";
+    std::vector<uint8_t> zip;
+    auto put = [&](const void* ptr, size_t size) {
+        auto const* p = static_cast<const uint8_t*>(ptr);
+        zip.insert(zip.end(), p, p + size);
+    };
+
+    LocalEntry le{};
+    le.sig = LocalEntry_SIG;
+    le.compSize = le.uncompSize = data.size();
+    le.nameLen = name.size();
+    put(&le, sizeof(le));
+    put(name.data(), name.size());
+    put(data.data(), data.size());
+
+    auto const cdOffset = zip.size();
+    CentralDirEntry cd{};
+    cd.sig = CentralDirEntry_SIG;
+    cd.compSize = data.size();
+    cd.uncompSize = 0xffffffff;
+    cd.nameLen = name.size();
+    cd.exLen = 12;
+    put(&cd, sizeof(cd));
+    put(name.data(), name.size());
+    const uint16_t head[2] = {0x01, 8};
+    const int64_t uncompSize = data.size();
+    put(head, 4);
+    put(&uncompSize, 8);
+
+    EndOfCentralDir eocd{};
+    eocd.id = EndOfCD_SIG;
+    eocd.entries = eocd.diskentries = 1;
+    eocd.cdsize = zip.size() - cdOffset;
+    eocd.cdoffset = cdOffset;
+    put(&eocd, sizeof(eocd));
+
+    makedirs("temp");
+    File{"temp/zip64extra.zip", File::WRITE}.Write(zip.data(), zip.size());
+    ZipStream zs{"temp/zip64extra.zip"};
+    REQUIRE(zs.valid());
+    REQUIRE(zs.size() == 1);
+    auto const& e = zs.getEntry(0);
+    REQUIRE(e.offset == 0);
+    REQUIRE(e.compSize == data.size());
+    REQUIRE(e.uncompSize == data.size());
+}
+
 #if 0
 TEST_CASE("big", "")
 {
@@ -182,3 +685,280 @@ TEST_CASE("64k", "")
 
 }
 #endif
+
+TEST_CASE("worklist", "")
+{
+    WorkList<FileTarget, std::string, &FileTarget::target> list;
+    list.emplace_back("a", "x");
+    list.emplace_back("b", "y");
+    list.emplace_back("c", "x");
+    list.emplace_back("d", "z");
+    REQUIRE(list.size() == 3);
+
+    // Replaced item is skipped
+    REQUIRE(list.claim() == 1);
+    REQUIRE(list.claim() == 2);
+    REQUIRE(list.claim() == 3);
+    REQUIRE(list.claim() == -1);
+
+    list.compact();
+    REQUIRE(list[0].source == "b");
+    REQUIRE(list[1].source == "c");
+    REQUIRE(list[2].source == "d");
+}
+
+TEST_CASE("walkdir", "")
+{
+    if (!fileExists("temp/zipme"))
+        createFiles("temp/zipme/f", 10, 128 * 1024);
+    if (!fileExists("temp/zipme/sub"))
+        createFiles("temp/zipme/sub/deeper/g", 10, 1024);
+
+    std::vector<std::string> listed;
+    listFiles(std::string("temp/zipme"), [&](const std::string& path) {
+        listed.push_back(path);
+    });
+
+    std::mutex m;
+    std::vector<std::string> walked;
+    int failed = 0;
+    walkDir("temp/zipme", 4,
+            [&](const std::string& path, const struct stat* st) {
+                std::lock_guard lock{m};
+                walked.push_back(path);
+                failed += st == nullptr;
+            });
+
+    REQUIRE(failed == 0);
+    std::sort(listed.begin(), listed.end());
+    std::sort(walked.begin(), walked.end());
+    REQUIRE(listed == walked);
+}
+
+int64_t iz_deflate(int level, char* tgt, char* src, unsigned long tgtsize,
+                   unsigned long srcsize, char* dict, unsigned dictsize,
+                   bool syncflush, void (*scan)(void*, const char*, unsigned),
+                   void* scanHandle);
+uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32);
+uint32_t crc32_bitwise(const void* data, size_t length,
+                       uint32_t previousCrc32);
+uint32_t crc32_combine(uint32_t crcA, uint32_t crcB, size_t lengthB);
+uint32_t crc32_combine_gen(size_t lengthB);
+uint32_t crc32_combine_op(uint32_t crcA, uint32_t crcB, uint32_t op);
+
+TEST_CASE("crc32", "")
+{
+    std::vector<uint8_t> data(4096 + 64);
+    for (auto& d : data)
+        d = rand() % 0x100;
+
+    // All short lengths and alignments, so every tail path is hit
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 0; length <= 300; length++) {
+            auto const* ptr = &data[offset];
+            REQUIRE(crc32_fast(ptr, length, 0) ==
+                    crc32_bitwise(ptr, length, 0));
+        }
+    }
+    REQUIRE(crc32_fast(&data[3], 4096, 0) ==
+            crc32_bitwise(&data[3], 4096, 0));
+
+    // Chained
+    auto const crc = crc32_fast(&data[0], 1000, 0);
+    REQUIRE(crc32_fast(&data[1000], 3000, crc) ==
+            crc32_bitwise(&data[0], 4000, 0));
+}
+
+TEST_CASE("crc32 combine", "")
+{
+    std::vector<uint8_t> data(1024);
+    for (auto& d : data)
+        d = rand() % 0x100;
+
+    // Every split of every prefix
+    for (size_t total = 0; total <= data.size(); total += 31) {
+        auto const expected = crc32_bitwise(&data[0], total, 0);
+        for (size_t split = 0; split <= total; split++) {
+            auto const crcA = crc32_bitwise(&data[0], split, 0);
+            auto const crcB = crc32_bitwise(&data[split], total - split, 0);
+            REQUIRE(crc32_combine(crcA, crcB, total - split) == expected);
+        }
+    }
+
+    // Many equal blocks with one operator
+    auto const op = crc32_combine_gen(64);
+    uint32_t crc = 0;
+    for (size_t i = 0; i < data.size(); i += 64)
+        crc = crc32_combine_op(crc, crc32_bitwise(&data[i], 64, 0), op);
+    REQUIRE(crc == crc32_bitwise(&data[0], data.size(), 0));
+
+    // Lengths too large to check directly must compose
+    for (uint64_t length : {1ULL << 29, 1ULL << 32, (1ULL << 40) + 12345}) {
+        auto const twice = crc32_combine(
+            crc32_combine(0x12345678, 0, length), 0x9abcdef0, length);
+        REQUIRE(crc32_combine(0x12345678, 0x9abcdef0, 2 * length) == twice);
+    }
+}
+
+struct BenchScan
+{
+    uint32_t crc = 0;
+    SHA_CTX sha;
+};
+
+// Compare checksumming the input in separate passes before deflating with
+// doing it on each block as the deflater reads it. Prints the time the
+// checksums add on top of deflate alone. Run with 'fstest [bench]'.
+TEST_CASE("fused scan", "[.][bench]")
+{
+    const size_t size = 64 * 1024 * 1024;
+    const size_t outSize = size + (size / 16383 + 1) * 5 + 64 * 1024;
+    auto in = std::make_unique<char[]>(size);
+    auto out = std::make_unique<char[]>(outSize);
+    // Something like text, so deflate does real work
+    for (size_t i = 0; i < size; i++)
+        in[i] = (rand() % 8) ? 'a' + rand() % 16 : ' ';
+    memset(out.get(), 0, outSize);
+
+    int64_t bits0 = 0;
+    int64_t bits1 = 0;
+    uint32_t crc0 = 0;
+    uint8_t sha0[20];
+    uint8_t sha1[20];
+    BenchScan scan;
+
+    const double deflateOnly = bestTime([&] {
+        iz_deflate(1, out.get(), in.get(), outSize, size, nullptr, 0, false,
+                   nullptr, nullptr);
+    });
+    const double separate = bestTime([&] {
+        SHA_CTX context;
+        SHA1_Init(&context);
+        SHA1_Update(&context, in.get(), size);
+        SHA1_Final(sha0, &context);
+        crc0 = crc32_fast(in.get(), size, 0);
+        bits0 = iz_deflate(1, out.get(), in.get(), outSize, size, nullptr, 0,
+                           false, nullptr, nullptr);
+    });
+    const double fused = bestTime([&] {
+        scan.crc = 0;
+        SHA1_Init(&scan.sha);
+        bits1 = iz_deflate(
+            1, out.get(), in.get(), outSize, size, nullptr, 0, false,
+            [](void* handle, const char* data, unsigned len) {
+                auto* s = static_cast<BenchScan*>(handle);
+                s->crc = crc32_fast(data, len, s->crc);
+                SHA1_Update(&s->sha, data, len);
+            },
+            &scan);
+        SHA1_Final(sha1, &scan.sha);
+    });
+
+    printf("Deflate %.1f MB/s, checksums add %.1f ms in separate passes, "
+           "%.1f ms fused\n",
+           size / deflateOnly / (1024 * 1024), (separate - deflateOnly) * 1000,
+           (fused - deflateOnly) * 1000);
+
+    REQUIRE(bits0 == bits1);
+    REQUIRE(crc0 == scan.crc);
+    REQUIRE(memcmp(sha0, sha1, 20) == 0);
+}
+
+// Deflate 'data' with Info-ZIP; empty if it would be stored
+static std::vector<uint8_t> deflateData(const std::vector<char>& data,
+                                        int level)
+{
+    std::vector<char> out(data.size() + (data.size() / 16383 + 1) * 5 +
+                          64 * 1024);
+    auto in = data;
+    auto const bits =
+        iz_deflate(level, out.data(), in.data(), out.size(), in.size(),
+                   nullptr, 0, false, nullptr, nullptr);
+    if (bits < 0)
+        return {};
+    return std::vector<uint8_t>(out.begin(), out.begin() + (bits + 7) / 8);
+}
+
+static std::vector<char> textData(size_t size)
+{
+    std::vector<char> data(size);
+    for (auto& c : data)
+        c = (rand() % 8) ? 'a' + rand() % 16 : ' ';
+    return data;
+}
+
+TEST_CASE("inflate engines", "")
+{
+    std::vector<std::vector<char>> inputs;
+    for (size_t size : {1, 100, 300, 70000, 1000000})
+        inputs.push_back(textData(size));
+    // Long runs and short repeats exercise the overlapping copies
+    inputs.emplace_back(200000, 'x');
+    std::vector<char> periods;
+    for (int period = 2; period < 20; period++) {
+        for (int i = 0; i < 5000; i++)
+            periods.push_back('a' + i % period);
+    }
+    inputs.push_back(periods);
+
+    for (auto const& data : inputs) {
+        for (int level : {1, 5, 9}) {
+            auto const packed = deflateData(data, level);
+            if (packed.empty())
+                continue;
+            std::vector<uint8_t> out(data.size());
+            REQUIRE(inflateFast(packed.data(), packed.size(), out.data(),
+                                out.size()));
+            REQUIRE(memcmp(out.data(), data.data(), data.size()) == 0);
+            if (!data.empty()) {
+                REQUIRE(!inflateFast(packed.data(), packed.size(), out.data(),
+                                     out.size() - 1));
+                REQUIRE(!inflateFast(packed.data(), packed.size() / 2,
+                                     out.data(), out.size()));
+            }
+        }
+    }
+}
+
+TEST_CASE("parallel inflate of compressible data", "")
+{
+    // Compresses far better than the ratio a guessed part may inflate to,
+    // so every part after the first is inflated again from a known start
+    std::vector<char> data;
+    for (int i = 0; data.size() < 32 * 1024 * 1024; i++) {
+        auto const line = "Line " + std::to_string(i) + " of the log\n";
+        data.insert(data.end(), line.begin(), line.end());
+    }
+    auto const packed = deflateData(data, 5);
+    REQUIRE(packed.size() * 8 < data.size());
+    std::vector<uint8_t> out(data.size());
+    REQUIRE(inflateParallel(packed.data(), packed.size(), out.data(),
+                            out.size(), 4));
+    REQUIRE(memcmp(out.data(), data.data(), data.size()) == 0);
+}
+
+TEST_CASE("inflate speed", "[.][bench]")
+{
+    auto const data = textData(64 * 1024 * 1024);
+    auto const packed = deflateData(data, 5);
+    std::vector<uint8_t> out(data.size());
+
+    const double miniz = bestTime([&] {
+        mz_stream stream{};
+        mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS);
+        stream.next_in = packed.data();
+        stream.avail_in = packed.size();
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        REQUIRE(mz_inflate(&stream, MZ_FINISH) == MZ_STREAM_END);
+        mz_inflateEnd(&stream);
+    });
+    const double fast = bestTime([&] {
+        REQUIRE(inflateFast(packed.data(), packed.size(), out.data(),
+                            out.size()));
+    });
+    printf("Inflate: miniz %.1f MB/s, fast %.1f MB/s\n",
+           data.size() / miniz / (1024 * 1024),
+           data.size() / fast / (1024 * 1024));
+    REQUIRE(memcmp(out.data(), data.data(), data.size()) == 0);
+}
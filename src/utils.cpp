@@ -1,11 +1,20 @@
 #include "utils.h"
 
+#include <condition_variable>
 #include <ctime>
 #include <experimental/filesystem>
+#include <mutex>
+#include <thread>
 
 #ifdef _WIN32
 #    include <direct.h>
 #endif
+#ifdef __linux__
+#    include <dirent.h>
+#    include <fcntl.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#endif
 
 namespace fs = std::experimental::filesystem;
 
@@ -71,6 +80,145 @@ void listFiles(const std::string& dirName,
     _listFiles(dirName, f);
 }
 
+#ifdef __linux__
+
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+
+// Directories waiting to be read by the walker threads, with an open fd if
+// we could afford to keep one
+struct WalkState
+{
+    WalkState(const WalkFunction& aF, bool aParallel)
+        : f(aF), parallel(aParallel)
+    {}
+    const WalkFunction& f;
+    bool parallel;
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::pair<int, std::string>> dirs;
+    int active = 0;
+};
+
+static void walkOne(WalkState& ws, int fd, const std::string& path)
+{
+    if (fd < 0)
+        fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    alignas(linux_dirent64) char buf[32 * 1024];
+    std::string name = path;
+    if (name.back() != '/')
+        name += '/';
+    const size_t base = name.size();
+
+    while (true) {
+        const long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (long pos = 0; pos < n;) {
+            auto const* d = reinterpret_cast<linux_dirent64*>(&buf[pos]);
+            pos += d->d_reclen;
+            const char* dn = d->d_name;
+            if (dn[0] == '.' && (dn[1] == 0 || (dn[1] == '.' && dn[2] == 0)))
+                continue;
+            name.resize(base);
+            name += dn;
+
+            // Links are followed, like fs::is_directory() does
+            struct stat st;
+            bool ok = true;
+            bool isDir = d->d_type == DT_DIR;
+            if (!isDir) {
+                ok = fstatat(fd, dn, &st, 0) == 0;
+                isDir = ok && S_ISDIR(st.st_mode);
+            }
+            if (!isDir) {
+                ws.f(name, ok ? &st : nullptr);
+                continue;
+            }
+
+            if (!ws.parallel) {
+                walkOne(ws, openat(fd, dn, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                        name);
+                continue;
+            }
+            {
+                std::lock_guard lock{ws.m};
+                // Don't hold on to too many fds, open later by path instead
+                const int sub =
+                    ws.dirs.size() < 256
+                        ? openat(fd, dn, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                        : -1;
+                ws.dirs.emplace_back(sub, name);
+            }
+            ws.cv.notify_one();
+        }
+    }
+    close(fd);
+}
+
+void walkDir(const std::string& dirName, int threadCount,
+             const WalkFunction& f)
+{
+    struct stat st;
+    const bool ok = stat(dirName.c_str(), &st) == 0;
+    if (!ok || !S_ISDIR(st.st_mode)) {
+        f(dirName, ok ? &st : nullptr);
+        return;
+    }
+
+    WalkState ws{f, threadCount > 1};
+    if (!ws.parallel) {
+        walkOne(ws, -1, dirName);
+        return;
+    }
+
+    ws.dirs.emplace_back(-1, dirName);
+    std::vector<std::thread> threads(threadCount);
+    for (auto& t : threads) {
+        t = std::thread([&ws] {
+            std::unique_lock lock{ws.m};
+            while (true) {
+                while (ws.dirs.empty() && ws.active > 0)
+                    ws.cv.wait(lock);
+                if (ws.dirs.empty())
+                    break;
+                auto dir = std::move(ws.dirs.back());
+                ws.dirs.pop_back();
+                ws.active++;
+                lock.unlock();
+                walkOne(ws, dir.first, dir.second);
+                lock.lock();
+                ws.active--;
+                if (ws.active == 0 && ws.dirs.empty())
+                    ws.cv.notify_all();
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+}
+
+#else
+
+void walkDir(const std::string& dirName, int, const WalkFunction& f)
+{
+    listFiles(dirName, [&](const std::string& path) {
+        struct stat st;
+        f(path, stat(path.c_str(), &st) == 0 ? &st : nullptr);
+    });
+}
+
+#endif
+
 time_t msdosToUnixTime(uint32_t m)
 {
     struct tm t;
@@ -84,6 +232,21 @@ time_t msdosToUnixTime(uint32_t m)
     return mktime(&t);
 }
 
+uint32_t unixToMsdosTime(time_t t)
+{
+    struct tm lt;
+#ifdef _WIN32
+    localtime_s(&lt, &t);
+#else
+    localtime_r(&t, &lt);
+#endif
+    // date:   YYYYYYYM MMMDDDDD
+    // time:   HHHHHMMM MMMSSSSS
+    return ((lt.tm_year - 80) << 25) | ((lt.tm_mon + 1) << 21) |
+           (lt.tm_mday << 16) | (lt.tm_hour << 11) | (lt.tm_min << 5) |
+           (lt.tm_sec >> 1);
+}
+
 fs::file_time_type msdosToFileTime(uint32_t m)
 {
     return fs::file_time_type::clock::from_time_t(msdosToUnixTime(m));
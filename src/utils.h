@@ -1,13 +1,14 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <ctime>
 #include <deque>
 #include <functional>
-#include <set>
 #include <string>
 #include <sys/stat.h>
+#include <unordered_map>
 #include <vector>
 
 #include <experimental/filesystem>
@@ -53,6 +54,17 @@ void listFiles(const std::string& dirName,
                const std::function<void(const std::string& path)>& f);
 void removeFiles(const std::string& dirName);
 
+// Called for every file found by walkDir(). 'st' is nullptr if the file
+// could not be stat'ed.
+using WalkFunction =
+    std::function<void(const std::string& path, const struct stat* st)>;
+
+// Recursively list all files under 'dirName' like listFiles(), but stat
+// each file once while walking. With more than one thread, directories are
+// read in parallel and 'f' may be called from several threads at once.
+void walkDir(const std::string& dirName, int threadCount,
+             const WalkFunction& f);
+
 template <class CONTAINER>
 void listFiles(char* dirName, CONTAINER& rc, int& strSize)
 {
@@ -69,71 +81,73 @@ int listFiles(const std::string& dirName, CONTAINER& rc)
     return strSize;
 }
 
-template <typename T>
-class UniQueue : public std::deque<std::reference_wrapper<const T>>
+// List of items that are unique on the member KEY. Adding an item with a key
+// that is already present replaces the earlier one, which is left behind as a
+// tombstone so indices of other items stay valid. Once all items are added,
+// worker threads can claim them in order through an atomic cursor.
+template <class T, class K, K T::*KEY> class WorkList
 {
 public:
-    using KEY = std::reference_wrapper<const T>;
-    using PARENT = std::deque<KEY>;
-
-    void push_back(const T& value)
+    template <class... S> void emplace_back(S&&... s)
     {
-        if (dirty)
-            cleanup();
-        auto r = unique.insert(value);
-        KEY key = std::cref(*r.first);
-        if (!r.second) {
-            // If already present we must remove the prevous one in the deck
-            auto it = std::find_if(
-                PARENT::begin(), PARENT::end(),
-                [&](const KEY& k) -> bool { return key.get() == k.get(); });
-            PARENT::erase(it);
-            unique.erase(r.first);
-            r = unique.insert(value);
-            key = std::cref(*r.first);
+        const int i = items.size();
+        items.emplace_back(std::forward<S>(s)...);
+        dead.push_back(false);
+        auto r = index.emplace(items.back().*KEY, i);
+        if (r.second)
+            liveCount++;
+        else {
+            dead[r.first->second] = true;
+            r.first->second = i;
         }
-        PARENT::push_back(key);
     }
 
-    template <class... S> void emplace_back(S&&... s)
+    void push_back(const T& value) { emplace_back(value); }
+
+    size_t size() const { return liveCount; }
+    bool empty() const { return liveCount == 0; }
+
+    const T& operator[](size_t i) const { return items[i]; }
+
+    // Remove tombstones so live items are numbered 0 to size() - 1
+    void compact()
     {
-        if (dirty)
-            cleanup();
-        auto r = unique.emplace(std::forward<S>(s)...);
-        KEY key = std::cref(*r.first);
-        if (!r.second) { // If already present we must remove the prevous one in
-                         // the deck
-            auto it = std::find_if(
-                PARENT::begin(), PARENT::end(),
-                [&](const KEY& k) -> bool { return key.get() == k.get(); });
-            PARENT::erase(it);
-            unique.erase(r.first);
-            r = unique.emplace(std::forward<S>(s)...);
-            key = std::cref(*r.first);
+        if (liveCount == items.size())
+            return;
+        std::deque<T> live;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (!dead[i]) {
+                index[items[i].*KEY] = live.size();
+                live.push_back(std::move(items[i]));
+            }
         }
-        PARENT::push_back(key);
+        items = std::move(live);
+        dead.assign(items.size(), false);
     }
 
-    void pop_front()
+    // Claim the next live item, returns -1 when all are taken
+    int claim()
     {
-        dirty = true;
-        PARENT::pop_front();
+        while (true) {
+            const size_t i = cursor++;
+            if (i >= items.size())
+                return -1;
+            if (!dead[i])
+                return i;
+        }
     }
 
-    std::set<T>& data() { return unique; }
-
 private:
-    void cleanup()
-    {
-        fprintf(stderr, "Warning: Expensive to use UniQueue this way");
-        // dirty = false;
-    }
-
-    std::set<T> unique;
-    bool dirty = false;
+    std::deque<T> items;
+    std::vector<bool> dead;
+    std::unordered_map<K, int> index;
+    size_t liveCount = 0;
+    std::atomic<size_t> cursor{0};
 };
 
 std::time_t msdosToUnixTime(uint32_t m);
+// Local time in zip (MS-DOS) format, with 2 second resolution. Thread safe.
+uint32_t unixToMsdosTime(std::time_t t);
 std::experimental::filesystem::file_time_type msdosToFileTime(uint32_t m);
 void makedir(const std::string& name);
 void makedirs(const std::string& path);
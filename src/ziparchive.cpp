@@ -1,23 +1,186 @@
 #include "ziparchive.h"
 #include "utils.h"
 #include "zipformat.h"
+#include "zipstream.h"
 
 #include "file.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <ctime>
 #include <sys/stat.h>
 
-ZipArchive::ZipArchive(const std::string& fileName, int numFiles, int strLen)
-    : f{fileName, File::WRITE}
+ZipArchive::ZipArchive(const std::string& fileName, int numFiles, int strLen,
+                       Mode mode)
+    : archiveName(fileName),
+      f{fileName, mode == UPDATE ? File::UPDATE : File::WRITE}
 {
     static_assert(sizeof(LocalEntry) == 30);
     static_assert(sizeof(CentralDirEntry) == 46);
 
-    entries = std::make_unique<uint8_t[]>(
-        strLen + numFiles * (sizeof(CentralDirEntry) + sizeof(Extra64)));
-    entryPtr = entries.get();
+    entries.reserve(strLen +
+                    numFiles * (sizeof(CentralDirEntry) + sizeof(Extra64)));
     entryCount = 0;
+    if (mode == UPDATE)
+        readExisting();
+}
+
+static uint32_t centralSize(const uint8_t* record)
+{
+    CentralDirEntry cd;
+    memcpy(&cd, record, sizeof(cd));
+    return sizeof(cd) + cd.nameLen + cd.exLen + cd.commLen;
+}
+
+// Point a central directory record at a new local header, which must not be
+// further into the file if the record has no zip64 offset
+static void setCentralOffset(std::vector<uint8_t>& record, uint64_t offset)
+{
+    CentralDirEntry cd;
+    memcpy(&cd, record.data(), sizeof(cd));
+    if (cd.offset != 0xffffffff) {
+        cd.offset = offset;
+        memcpy(record.data(), &cd, sizeof(cd));
+        return;
+    }
+    // The zip64 extra field only has the values that overflowed, in order
+    size_t pos = sizeof(cd) + cd.nameLen;
+    const size_t end = pos + cd.exLen;
+    while (pos + 4 <= end) {
+        uint16_t head[2];
+        memcpy(head, &record[pos], 4);
+        if (head[0] == 0x01) {
+            size_t field = pos + 4;
+            if (cd.uncompSize == 0xffffffff)
+                field += 8;
+            if (cd.compSize == 0xffffffff)
+                field += 8;
+            if (field + 8 <= end)
+                memcpy(&record[field], &offset, 8);
+            return;
+        }
+        pos += 4 + head[1];
+    }
+}
+
+void ZipArchive::readExisting()
+{
+    updating = true;
+    if (!f.isOpen())
+        throw zip_exception("Could not open " + archiveName);
+    ZipStream zs{archiveName};
+    if (!zs.valid())
+        throw zip_exception("Not a zip archive: " + archiveName);
+
+    std::vector<uint8_t> cd(zs.centralSize());
+    if (f.readAt(cd.data(), cd.size(), zs.centralOffset()) != cd.size())
+        throw zip_exception("Could not read central directory");
+
+    size_t pos = 0;
+    for (auto const& e : zs) {
+        if (pos + sizeof(CentralDirEntry) > cd.size() ||
+            pos + centralSize(&cd[pos]) > cd.size())
+            throw zip_exception("Bad central directory in " + archiveName);
+        const uint32_t size = centralSize(&cd[pos]);
+
+        LocalEntry head;
+        if (f.readAt(&head, sizeof(head), e.offset) != sizeof(head) ||
+            head.sig != LocalEntry_SIG)
+            throw zip_exception("Bad local header for " + e.name);
+        uint64_t end = e.offset + sizeof(head) + head.nameLen + head.exLen +
+                       e.compSize;
+        if (head.bits & 8) {
+            // Data descriptor, with or without signature
+            uint32_t sig = 0;
+            f.readAt(&sig, 4, end);
+            const bool large =
+                e.compSize >= 0xffffffff || e.uncompSize >= 0xffffffff;
+            end += (sig == 0x08074b50 ? 4 : 0) + 4 + (large ? 16 : 8);
+        }
+
+        Placed placed{(uint64_t)e.offset, end,
+                      std::vector<uint8_t>(&cd[pos], &cd[pos] + size)};
+        existingIndex[e.name] = existing.size();
+        existing.push_back(std::move(placed));
+        pos += size;
+    }
+
+    // Whatever follows the last entry (central directory, signing block)
+    // is overwritten; gaps between entries can be reused
+    std::vector<const Placed*> order;
+    for (auto const& e : existing)
+        order.push_back(&e);
+    std::sort(order.begin(), order.end(),
+              [](auto* a, auto* b) { return a->offset < b->offset; });
+    dataStart = order.empty() ? zs.centralOffset() : order.front()->offset;
+    nextOffset = dataStart;
+    for (auto* e : order) {
+        if (e->offset > nextOffset)
+            holes[nextOffset] = e->offset - nextOffset;
+        nextOffset = std::max(nextOffset, e->end);
+    }
+    counters.kept = existing.size();
+}
+
+void ZipArchive::release(const std::string& name)
+{
+    auto it = existingIndex.find(name);
+    if (it == existingIndex.end())
+        return;
+    auto& e = existing[it->second];
+    existingIndex.erase(it);
+    e.replaced = true;
+    counters.kept--;
+    counters.replaced++;
+    addHole(e.offset, e.end - e.offset);
+}
+
+void ZipArchive::addHole(uint64_t offset, uint64_t size)
+{
+    auto next = holes.lower_bound(offset);
+    if (next != holes.end() && next->first == offset + size) {
+        size += next->second;
+        next = holes.erase(next);
+    }
+    if (next != holes.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            holes.erase(prev);
+        }
+    }
+    if (offset + size == nextOffset)
+        nextOffset = offset;
+    else
+        holes[offset] = size;
+}
+
+bool ZipArchive::fillHole(const ZipEntry& entry, Reservation& r)
+{
+    const uint64_t minSize =
+        sizeof(LocalEntry) + entry.name.length() + entry.dataSize;
+    for (auto it = holes.begin(); it != holes.end(); ++it) {
+        if (it->second < minSize)
+            continue;
+        // The header depends on the offset (alignment, zip64)
+        lastHeader = it->first;
+        auto header = makeHeader(entry);
+        const uint64_t size = header.size() + entry.dataSize;
+        if (size > it->second)
+            continue;
+        const uint64_t offset = it->first;
+        const uint64_t left = it->second - size;
+        holes.erase(it);
+        if (left > 0)
+            holes[offset + size] = left;
+        r.offset = offset;
+        r.header = std::move(header);
+        counters.filled++;
+        return true;
+    }
+    return false;
 }
 
 void ZipArchive::addFile(const std::string& fileName, bool store,
@@ -38,27 +201,232 @@ void ZipArchive::addFile(const std::string& fileName, bool store,
     add(ze);
 }
 
+void ZipArchive::doDigest(int threadCount)
+{
+    digest = std::make_unique<ContentDigest>(archiveName, threadCount);
+}
+
 void ZipArchive::add(const ZipEntry& entry)
+{
+    auto r = place(entry);
+    writePos = r.offset;
+    write(r.header.data(), r.header.size());
+    if (entry.data || !entry.copyFrom.empty()) {
+        writeData(entry, writePos);
+        writePos += entry.dataSize;
+        nextOffset = std::max(nextOffset, writePos);
+    }
+    if (digest) {
+        std::lock_guard lock{markLock};
+        seqMark = writePos;
+        updateMark();
+    }
+}
+
+ZipArchive::Reservation ZipArchive::place(const ZipEntry& entry)
+{
+    Reservation r;
+    if (updating) {
+        release(entry.name);
+        if (fillHole(entry, r)) {
+            addCentral(entry, r.offset + r.header.size() + entry.dataSize);
+            return r;
+        }
+    }
+    r.offset = lastHeader = nextOffset;
+    r.header = makeHeader(entry);
+    nextOffset += r.header.size() + entry.dataSize;
+    addCentral(entry, nextOffset);
+    return r;
+}
+
+ZipArchive::Reservation ZipArchive::reserve(const ZipEntry& entry)
+{
+    auto r = place(entry);
+    if (digest) {
+        std::lock_guard lock{markLock};
+        unwritten.insert(r.offset);
+        if (seqMark == r.offset)
+            seqMark = nextOffset;
+    }
+    return r;
+}
+
+void ZipArchive::writeEntry(const Reservation& r, const ZipEntry& entry)
+{
+    {
+#ifdef _WIN32
+        std::lock_guard<std::mutex> lock{writeLock};
+#endif
+        writeAt(r.header.data(), r.header.size(), r.offset);
+        writeData(entry, r.offset + r.header.size());
+    }
+    if (digest) {
+        std::lock_guard lock{markLock};
+        unwritten.erase(r.offset);
+        updateMark();
+    }
+}
+
+void ZipArchive::updateMark()
+{
+    uint64_t mark = seqMark;
+    if (!unwritten.empty())
+        mark = std::min(mark, *unwritten.begin());
+#ifdef _WIN32
+    fflush(f.filePointer());
+#endif
+    digest->setMark(mark);
+}
+
+void ZipArchive::writeAt(const uint8_t* data, uint64_t size, uint64_t offset)
+{
+    if (f.writeAt(data, size, offset) != size)
+        writeFailed = true;
+}
+
+void ZipArchive::checkWrites()
+{
+    if (writeFailed)
+        throw zip_exception("Could not write to " + archiveName);
+}
+
+// Copy 'size' bytes between two files without moving the file positions.
+// copy_file_range() keeps the data in the kernel, where filesystems that
+// can share blocks between files (btrfs, xfs) may avoid copying them at all.
+static bool copyRange(File& from, uint64_t fromOffset, File& to,
+                      uint64_t toOffset, uint64_t size)
+{
+#ifdef __linux__
+    while (size > 0) {
+        loff_t in = fromOffset;
+        loff_t out = toOffset;
+        auto rc = copy_file_range(fileno(from.filePointer()), &in,
+                                  fileno(to.filePointer()), &out, size, 0);
+        // Not possible between these files; copy what is left by hand
+        if (rc <= 0)
+            break;
+        fromOffset += rc;
+        toOffset += rc;
+        size -= rc;
+    }
+#endif
+    std::vector<uint8_t> buffer(std::min<uint64_t>(size, 1024 * 1024));
+    while (size > 0) {
+        const size_t n = std::min<uint64_t>(size, buffer.size());
+        if (from.readAt(buffer.data(), n, fromOffset) != n ||
+            to.writeAt(buffer.data(), n, toOffset) != n)
+            return false;
+        fromOffset += n;
+        toOffset += n;
+        size -= n;
+    }
+    return true;
+}
+
+void ZipArchive::writeData(const ZipEntry& entry, uint64_t offset)
+{
+    if (entry.data)
+        writeAt(entry.data.get(), entry.dataSize, offset);
+    else if (!entry.copyFrom.empty()) {
+        File source{entry.copyFrom};
+        // Thrown from close(), like other write failures
+        if (!source.isOpen() ||
+            !copyRange(source, entry.copyOffset, f, offset, entry.dataSize))
+            writeFailed = true;
+    }
+}
+
+void ZipArchive::beginEntry(const ZipEntry& entry)
+{
+    // The header is patched in endEntry(), so seqMark stays put until then
+    if (updating)
+        release(entry.name);
+    lastHeader = writePos = nextOffset;
+    auto header = makeHeader(entry);
+    write(header.data(), header.size());
+}
+
+void ZipArchive::endEntry(const ZipEntry& entry)
+{
+    // Patch crc and sizes in the local header
+    uint32_t crc = entry.crc;
+    writeAt((uint8_t*)&crc, 4, lastHeader + offsetof(LocalEntry, crc));
+    if (lastExt64) {
+        int64_t sizes[2] = {(int64_t)entry.originalSize,
+                            (int64_t)entry.dataSize};
+        writeAt((uint8_t*)sizes, sizeof(sizes),
+                lastHeader + sizeof(LocalEntry) + entry.name.length() + 4);
+    } else {
+        uint32_t sizes[2] = {(uint32_t)entry.dataSize,
+                             (uint32_t)entry.originalSize};
+        writeAt((uint8_t*)sizes, sizeof(sizes),
+                lastHeader + offsetof(LocalEntry, compSize));
+    }
+
+    addCentral(entry, writePos);
+    if (digest) {
+        std::lock_guard lock{markLock};
+        seqMark = writePos;
+        updateMark();
+    }
+}
+
+std::vector<uint8_t> ZipArchive::makeHeader(const ZipEntry& entry)
 {
     static LocalEntry head = {0x04034b50, 10, 0, 0, 0, 0, 0, 0, 0, 0};
     static Extra64 extra64 = {0x1, 28, 0, 0, 0, 0};
-    static const uint8_t zeroes[] = {0, 0, 0, 0};
-    const struct tm* lt = localtime(&entry.timeStamp);
-    // date:   YYYYYYYM MMMDDDDD
-    // time:   HHHHHMMM MMMSSSSS
-    uint32_t msdos_ts = ((lt->tm_year - 80) << 25) | ((lt->tm_mon + 1) << 21) |
-                        (lt->tm_mday << 16) | (lt->tm_hour << 11) |
-                        (lt->tm_min << 5) | (lt->tm_sec >> 1);
-
-    lastHeader = f.tell(); // ftell_x(fp);
+    lastTime = unixToMsdosTime(entry.timeStamp);
 
     int fl = entry.name.length();
-    auto* e = reinterpret_cast<CentralDirEntry*>(entryPtr);
 
     bool ext64 = force64;
     if (!ext64)
         ext64 = (entry.dataSize > 0xfffffffe ||
                  entry.originalSize > 0xfffffffe || lastHeader > 0xfffffffeL);
+    lastExt64 = ext64;
+
+    // lastHeader 30 bytes
+    head.method = entry.store ? 0 : 8;
+    head.crc = entry.crc;
+    head.v1 = 20;
+    head.compSize = ext64 ? 0xffffffff : entry.dataSize;
+    head.uncompSize = ext64 ? 0xffffffff : entry.originalSize;
+    head.dateTime = lastTime;
+    head.nameLen = fl;
+    head.exLen = 0;
+
+    if (entry.store && zipAlign)
+        head.exLen = 4 - (lastHeader + fl + sizeof(LocalEntry)) % 4;
+
+    if (ext64) {
+        head.exLen = sizeof(Extra64);
+        head.v1 = 45;
+        extra64.compSize = entry.dataSize;
+        extra64.uncompSize = entry.originalSize;
+        extra64.offset = lastHeader;
+    }
+
+    // Extra data is zero filled unless it is the zip64 block
+    std::vector<uint8_t> header(sizeof(LocalEntry) + fl + head.exLen);
+    memcpy(&header[0], &head, sizeof(LocalEntry));
+    memcpy(&header[sizeof(LocalEntry)], entry.name.c_str(), fl);
+    if (ext64)
+        memcpy(&header[sizeof(LocalEntry) + fl], &extra64, sizeof(Extra64));
+    return header;
+}
+
+void ZipArchive::addCentral(const ZipEntry& entry, uint64_t end)
+{
+    static Extra64 extra64 = {0x1, 28, 0, 0, 0, 0};
+
+    int fl = entry.name.length();
+    const bool ext64 = lastExt64;
+    const size_t start = entries.size();
+    entries.resize(start + sizeof(CentralDirEntry) + fl +
+                   (ext64 ? sizeof(Extra64) : 0) + entry.extra.size());
+    uint8_t* entryPtr = &entries[start];
+    auto* e = reinterpret_cast<CentralDirEntry*>(entryPtr);
 
     memset(e, 0, sizeof(CentralDirEntry));
     e->sig = 0x02014b50;
@@ -69,15 +437,13 @@ void ZipArchive::add(const ZipEntry& entry)
     e->uncompSize = ext64 ? 0xffffffff : entry.originalSize;
     e->nameLen = fl;
     e->offset = ext64 ? 0xffffffff : lastHeader;
-    e->dateTime = msdos_ts;
+    e->dateTime = lastTime;
     e->attr1 = entry.flags << 16;
 
     entryPtr += sizeof(CentralDirEntry);
     memcpy(entryPtr, entry.name.c_str(), fl);
     entryPtr += fl;
 
-    // ext64 = true;
-
     if (ext64) {
         e->v1 = 45;
         e->exLen += sizeof(Extra64);
@@ -87,49 +453,128 @@ void ZipArchive::add(const ZipEntry& entry)
         memcpy(entryPtr, &extra64, sizeof(Extra64));
         entryPtr += sizeof(Extra64);
     }
+    if (!entry.extra.empty()) {
+        e->exLen += entry.extra.size();
+        memcpy(entryPtr, entry.extra.data(), entry.extra.size());
+    }
 
+    if (updating)
+        added.push_back({lastHeader, end, {}, start});
     entryCount++;
+}
 
-    // printf("Added %d files in %ld bytes\n", entryCount, entryPtr - entries);
-
-    // lastHeader 30 bytes
-    head.method = entry.store ? 0 : 8;
-    head.crc = entry.crc;
-    head.v1 = 20;
-    head.compSize = ext64 ? 0xffffffff : entry.dataSize;
-    head.uncompSize = ext64 ? 0xffffffff : entry.originalSize;
-    head.dateTime = msdos_ts;
-    head.nameLen = fl;
-    head.exLen = 0;
+std::vector<uint8_t> ZipArchive::makeEnd(uint64_t startCD, bool end64)
+{
+    std::vector<uint8_t> end;
+    auto put = [&end](const auto& t) {
+        auto const* ptr = reinterpret_cast<const uint8_t*>(&t);
+        end.insert(end.end(), ptr, ptr + sizeof(t));
+    };
+    const uint64_t sizeCD = entries.size();
+    const uint64_t endCD = startCD + sizeCD;
 
-    if (entry.store && zipAlign)
-        head.exLen = 4 - (lastHeader + fl + sizeof(LocalEntry)) % 4;
+    if (end64) {
+        put(EndOfCentralDir64{0x06064b50, 44, 0x031e, 45, 0, 0, entryCount,
+                              entryCount, (int64_t)sizeCD, (int64_t)startCD});
+        // Locator
+        put((uint32_t)0x07064b50);
+        put((uint32_t)0);
+        put((uint64_t)endCD);
+        put((uint32_t)1);
+    }
+    put((uint32_t)0x06054b50);
+    put((uint16_t)0);
+    put((uint16_t)0);
+    put((uint16_t)(end64 ? 0xffff : entryCount));
+    put((uint16_t)(end64 ? 0xffff : entryCount));
+    put((uint32_t)sizeCD);
+    put((uint32_t)(end64 ? 0xffffffff : startCD));
+    put((uint16_t)0);
+    return end;
+}
 
-    if (ext64) {
-        head.exLen = sizeof(Extra64);
-        head.v1 = 45;
+void ZipArchive::closeUpdate()
+{
+    // Kept entries stay in their old order, followed by the added ones
+    std::vector<Placed> live;
+    for (auto& e : existing)
+        if (!e.replaced)
+            live.push_back(std::move(e));
+    for (size_t i = 0; i < added.size(); i++) {
+        auto const* start = &entries[added[i].centralPos];
+        auto const* end = i + 1 < added.size()
+                              ? &entries[added[i + 1].centralPos]
+                              : entries.data() + entries.size();
+        added[i].central.assign(start, end);
+        live.push_back(std::move(added[i]));
     }
 
-    write(head);
-    write(entry.name);
+    uint64_t startCD = nextOffset;
+    if (compact) {
+        std::vector<Placed*> order;
+        for (auto& e : live)
+            order.push_back(&e);
+        std::sort(order.begin(), order.end(),
+                  [](auto* a, auto* b) { return a->offset < b->offset; });
 
-    if (ext64) {
-        write(extra64);
-    } else if (head.exLen > 0) {
-        write(zeroes, head.exLen);
+        // Moving down never overwrites data that is still to be moved
+        auto buffer = std::make_unique<uint8_t[]>(1024 * 1024);
+        uint64_t pos = dataStart;
+        for (auto* e : order) {
+            uint64_t target = pos;
+            // Keep stored data aligned
+            if (zipAlign)
+                target += (e->offset - pos) % 4;
+            const uint64_t size = e->end - e->offset;
+            if (target < e->offset) {
+                for (uint64_t done = 0; done < size;) {
+                    const size_t n =
+                        std::min<uint64_t>(size - done, 1024 * 1024);
+                    if (f.readAt(buffer.get(), n, e->offset + done) != n)
+                        throw zip_exception("Could not read " + archiveName);
+                    writeAt(buffer.get(), n, target + done);
+                    checkWrites();
+                    done += n;
+                }
+                setCentralOffset(e->central, target);
+                e->offset = target;
+                e->end = target + size;
+                counters.moved++;
+            }
+            pos = target + size;
+        }
+        startCD = pos;
+        holes.clear();
     }
-    if (entry.data)
-        write(entry.data.get(), entry.dataSize);
-}
 
-void ZipArchive::close()
-{
-    auto startCD = f.tell(); // tell_x(fp);
+    entries.clear();
+    for (auto const& e : live)
+        entries.insert(entries.end(), e.central.begin(), e.central.end());
+    entryCount = live.size();
+    for (auto const& hole : holes)
+        counters.unused += hole.second;
 
-    write(entries.get(), entryPtr - entries.get());
-    auto sizeCD = f.tell() - startCD;
+    const bool end64 =
+        force64 || entryCount > 0xfffe || startCD > 0xfffffffeL;
+    writePos = startCD;
+    write(entries.data(), entries.size());
+    auto end = makeEnd(startCD, end64);
+    write(end.data(), end.size());
+    checkWrites();
+    if (!f.truncate(writePos))
+        throw zip_exception("Could not truncate " + archiveName);
+    f.close();
+}
 
-    auto endCD = f.tell();
+bool ZipArchive::close(const SigningBlock& signingBlock)
+{
+    // Don't write a central directory for entries that did not make it
+    checkWrites();
+    if (updating) {
+        closeUpdate();
+        return !signingBlock;
+    }
+    auto startCD = writePos = nextOffset;
 
     bool end64 = force64;
     if (!end64) {
@@ -137,24 +582,25 @@ void ZipArchive::close()
             end64 = true;
     }
 
-    if (end64) {
-        write<EndOfCentralDir64>({0x06064b50, 44, 0x031e, 45, 0, 0, entryCount,
-                                  entryCount, (int64_t)sizeCD,
-                                  (int64_t)startCD});
-        // Locator
-        write<uint32_t>(0x07064b50);
-        write<uint32_t>(0);
-        write<uint64_t>(endCD);
-        write<uint32_t>(1);
-    }
-    write<uint32_t>(0x06054b50);
-    write<uint16_t>(0);
-    write<uint16_t>(0);
-    write<uint16_t>(end64 ? 0xffff : entryCount);
-    write<uint16_t>(end64 ? 0xffff : entryCount);
-    write<uint32_t>(sizeCD);
-    write<uint32_t>(end64 ? 0xffffffff : startCD);
-    write<uint16_t>(0);
+    // The signing block is not covered by the digest; the end record it
+    // sees points at where the block starts
+    bool signedOk = true;
+    if (digest && signingBlock) {
+        if (end64)
+            signedOk = false;
+        else {
+            auto block = signingBlock(
+                digest->finish(startCD, entries, makeEnd(startCD, false)));
+            write(block.data(), block.size());
+            startCD = writePos;
+        }
+    }
+
+    write(entries.data(), entries.size());
+    auto end = makeEnd(startCD, end64);
+    write(end.data(), end.size());
+    checkWrites();
 
     f.close();
+    return signedOk;
 }
@@ -1,8 +1,16 @@
 #pragma once
 
+#include "contentdigest.h"
 #include "file.h"
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 struct zip_exception
 {
@@ -15,6 +23,12 @@ struct ZipEntry
     std::string name;
     bool store;
     std::unique_ptr<uint8_t[]> data;
+    // Without 'data', the data is copied from this file (if set) when the
+    // entry is written, starting at 'copyOffset'
+    std::string copyFrom;
+    uint64_t copyOffset = 0;
+    // Added to the extra field in the central directory
+    std::vector<uint8_t> extra;
     uint64_t dataSize;
     uint64_t originalSize;
     uint32_t crc;
@@ -28,28 +42,159 @@ struct ZipEntry
 class ZipArchive
 {
 public:
-    ZipArchive(const std::string& fileName, int numFiles = 0, int strLen = 0);
+    // Space in the archive set aside for one entry
+    struct Reservation
+    {
+        uint64_t offset = 0;
+        std::vector<uint8_t> header;
+    };
+
+    // Makes the APK Signing Block from the content digest of the archive
+    using SigningBlock =
+        std::function<std::vector<uint8_t>(const ContentDigest::Digest&)>;
+
+    enum Mode
+    {
+        CREATE,
+        // Open an existing archive and keep its entries. Added entries
+        // replace ones with the same name, and go into space that replaced
+        // entries leave behind if they fit, otherwise after the last entry.
+        // Only the central directory is rewritten.
+        UPDATE
+    };
+
+    struct UpdateStats
+    {
+        int kept = 0;
+        int replaced = 0;
+        // Added entries that went into unused space
+        int filled = 0;
+        // Entries moved by compaction
+        int moved = 0;
+        // Unused space left between entries
+        uint64_t unused = 0;
+    };
+
+    ZipArchive(const std::string& fileName, int numFiles = 0, int strLen = 0,
+               Mode mode = CREATE);
 
     void doAlign(bool align) { zipAlign = align; }
     void doForce64(bool f64) { force64 = f64; }
+    // When updating, move the entries together on close() so no unused
+    // space is left
+    void doCompact(bool c) { compact = c; }
+    UpdateStats updateStats() const { return counters; }
+    // Compute the content digest while the entries are written, so close()
+    // can insert a signing block. Must be called before anything is added.
+    void doDigest(int threadCount = 1);
+    // Counters of the content digest, if there is one
+    ContentDigest::Stats digestStats()
+    {
+        return digest ? digest->stats() : ContentDigest::Stats{};
+    }
 
     void addFile(const std::string& fileName, bool store = false,
                  uint64_t compSize = 0, uint64_t uncompSize = 0, time_t ts = 0,
                  uint32_t crc = 0, uint16_t flags = 0);
     void add(const ZipEntry& entry);
-    void close();
-    void write(const uint8_t* data, uint64_t size) { f.Write(data, size); }
+    // Reserve room for an entry and add it to the central directory. Only
+    // this needs to be serialized; the data can then be written using
+    // writeEntry() from any thread, in any order.
+    Reservation reserve(const ZipEntry& entry);
+    void writeEntry(const Reservation& r, const ZipEntry& entry);
+    // Start an entry whose data is then written in pieces using write().
+    // 'dataSize' must be an upper bound of the final size. endEntry() fills
+    // in the real size and checksum.
+    void beginEntry(const ZipEntry& entry);
+    void endEntry(const ZipEntry& entry);
+    // Write the central directory. If digesting, the block made by
+    // 'signingBlock' goes in front of it. Returns false if the block could
+    // not be added because the archive needs zip64.
+    bool close(const SigningBlock& signingBlock = nullptr);
+    void write(const uint8_t* data, uint64_t size)
+    {
+        writeAt(data, size, writePos);
+        writePos += size;
+        if (writePos > nextOffset)
+            nextOffset = writePos;
+    }
 
 private:
-    template <typename T> void write(const T& t) { f.Write(t); }
-    void write(const std::string& s) { f.Write(s.c_str(), s.length()); }
+    template <typename T> void write(const T& t)
+    {
+        write(reinterpret_cast<const uint8_t*>(&t), sizeof(T));
+    }
+    void write(const std::string& s)
+    {
+        write(reinterpret_cast<const uint8_t*>(s.c_str()), s.length());
+    }
+    // Failures are remembered, and thrown from close() on the calling
+    // thread, since entries are written from worker threads
+    void writeAt(const uint8_t* data, uint64_t size, uint64_t offset);
+    void checkWrites();
+    // Write the data of an entry, from memory or from 'copyFrom'
+    void writeData(const ZipEntry& entry, uint64_t offset);
+
+    Reservation place(const ZipEntry& entry);
+    std::vector<uint8_t> makeHeader(const ZipEntry& entry);
+    // 'end' is the offset after the data of the entry
+    void addCentral(const ZipEntry& entry, uint64_t end);
+    std::vector<uint8_t> makeEnd(uint64_t startCD, bool end64);
+    // Let the digest hash everything that is final
+    void updateMark();
+
+    void readExisting();
+    // Drop an existing entry that is being replaced, freeing its space
+    void release(const std::string& name);
+    void addHole(uint64_t offset, uint64_t size);
+    bool fillHole(const ZipEntry& entry, Reservation& r);
+    void closeUpdate();
 
     bool zipAlign = false;
     bool force64 = false;
+    bool lastExt64 = false;
+    uint32_t lastTime = 0;
 
-    std::unique_ptr<uint8_t[]> entries;
-    uint8_t* entryPtr;
+    std::vector<uint8_t> entries;
     uint64_t entryCount;
+    std::string archiveName;
     File f;
     uint64_t lastHeader = 0;
+    // End of all space handed out so far
+    uint64_t nextOffset = 0;
+    // Where write() puts its data
+    uint64_t writePos = 0;
+    std::atomic<bool> writeFailed{false};
+#ifdef _WIN32
+    std::mutex writeLock;
+#endif
+
+    std::unique_ptr<ContentDigest> digest;
+    std::mutex markLock;
+    // Reserved entries that writeEntry() has not written yet
+    std::set<uint64_t> unwritten;
+    // Everything before this is final, as far as add(), write() and
+    // streamed entries are concerned
+    uint64_t seqMark = 0;
+
+    // Entries of an archive being updated, and the added ones. 'central'
+    // is the central directory record, or its position in 'entries'.
+    struct Placed
+    {
+        uint64_t offset;
+        uint64_t end;
+        std::vector<uint8_t> central;
+        size_t centralPos = 0;
+        bool replaced = false;
+    };
+    bool updating = false;
+    bool compact = false;
+    std::vector<Placed> existing;
+    std::unordered_map<std::string, size_t> existingIndex;
+    std::vector<Placed> added;
+    // Where the first entry starts; anything before it is left alone
+    uint64_t dataStart = 0;
+    // Unused space between entries, offset -> size
+    std::map<uint64_t, uint64_t> holes;
+    UpdateStats counters;
 };
@@ -0,0 +1,215 @@
+#include "zipcache.h"
+
+#include "file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#define XXH_INLINE_ALL
+#include "xxhash/xxhash.h"
+
+// Bump when the deflater changes in a way that changes its output
+static const char MAGIC[8] = {'F', 'Z', 'C', 'A', 'C', 'H', 'E', '1'};
+
+enum
+{
+    STORED = 1
+};
+
+struct Header
+{
+    char magic[8];
+    CompressCache::Key key;
+    uint32_t crc;
+    uint32_t flags;
+    uint8_t sha[20];
+    uint32_t pad;
+    uint64_t dataSize;
+};
+static_assert(sizeof(Header) == 80, "Cache header must not have padding");
+
+struct CompressCache::Hasher::State
+{
+    XXH3_state_t xxh;
+};
+
+CompressCache::Hasher::Hasher() : state(std::make_unique<State>())
+{
+    XXH3_128bits_reset(&state->xxh);
+}
+
+CompressCache::Hasher::~Hasher() = default;
+
+void CompressCache::Hasher::update(const void* data, size_t size)
+{
+    XXH3_128bits_update(&state->xxh, data, size);
+}
+
+CompressCache::Key CompressCache::Hasher::finish(uint64_t size, int level,
+                                                 int engine)
+{
+    auto const hash = XXH3_128bits_digest(&state->xxh);
+    return {{hash.high64, hash.low64}, size, (uint32_t)level, (uint32_t)engine};
+}
+
+CompressCache::CompressCache(const fs::path& aDir, uint64_t aMaxSize)
+    : dir(aDir), maxSize(aMaxSize)
+{
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (!fs::is_directory(dir))
+        throw io_exception("Could not create cache directory " + dir.string());
+
+    for (auto const& e : fs::directory_iterator(dir, ec)) {
+        auto const name = e.path().filename().string();
+        if (!fs::is_regular_file(e.status()) ||
+            name.find('.') != std::string::npos)
+            continue;
+        const FileInfo info{fs::file_size(e.path(), ec),
+                            fs::last_write_time(e.path(), ec)};
+        if (ec)
+            continue;
+        files[name] = info;
+        totalSize += info.size;
+    }
+    counters.cacheSize = totalSize;
+}
+
+std::string CompressCache::fileName(const Key& key) const
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%016llx%016llx-%u-%u",
+             (unsigned long long)key.hash[0], (unsigned long long)key.hash[1],
+             key.level, key.engine);
+    return name;
+}
+
+bool CompressCache::get(const Key& key, Entry& entry, uint8_t* data,
+                        size_t capacity)
+{
+    auto const name = fileName(key);
+    auto const path = dir / name;
+    bool hit = false;
+    {
+        File f;
+        if (f.open(path.string().c_str(), File::READ)) {
+            Header head;
+            hit = f.Read(&head, sizeof(head)) == sizeof(head) &&
+                  memcmp(head.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                  memcmp(&head.key, &key, sizeof(key)) == 0 &&
+                  head.dataSize <= capacity &&
+                  f.Read(data, head.dataSize) == head.dataSize;
+            if (hit) {
+                entry.stored = (head.flags & STORED) != 0;
+                entry.crc = head.crc;
+                memcpy(entry.sha, head.sha, sizeof(entry.sha));
+                entry.dataSize = head.dataSize;
+            }
+        }
+    }
+
+    // The modification time doubles as last use time, so other processes
+    // sharing the directory see the access too
+    auto const now = fs::file_time_type::clock::now();
+    if (hit) {
+        std::error_code ec;
+        fs::last_write_time(path, now, ec);
+    }
+
+    std::lock_guard lock{m};
+    counters.lookups++;
+    if (hit) {
+        counters.hits++;
+        counters.savedBytes += key.size;
+        auto it = files.find(name);
+        if (it != files.end())
+            it->second.used = now;
+    }
+    return hit;
+}
+
+void CompressCache::put(const Key& key, const Entry& entry,
+                        const uint8_t* data)
+{
+    Header head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, MAGIC, sizeof(MAGIC));
+    head.key = key;
+    head.crc = entry.crc;
+    head.flags = entry.stored ? STORED : 0;
+    memcpy(head.sha, entry.sha, sizeof(head.sha));
+    head.dataSize = entry.stored ? 0 : entry.dataSize;
+
+    // Written under a temporary name and renamed into place, so readers never
+    // see a partial entry
+    auto const name = fileName(key);
+    thread_local std::mt19937_64 random{std::random_device{}()};
+    auto const tempPath = dir / (name + "." + std::to_string(random()));
+    {
+        File f;
+        if (!f.open(tempPath.string().c_str(), File::WRITE))
+            return;
+        const bool ok =
+            f.Write(&head, sizeof(head)) == sizeof(head) &&
+            f.Write(data, head.dataSize) == head.dataSize;
+        f.close();
+        if (!ok) {
+            std::error_code ec;
+            fs::remove(tempPath, ec);
+            return;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tempPath, dir / name, ec);
+    if (ec) {
+        fs::remove(tempPath, ec);
+        return;
+    }
+
+    bool full;
+    {
+        std::lock_guard lock{m};
+        const uint64_t size = sizeof(head) + head.dataSize;
+        auto& info = files[name];
+        totalSize = totalSize - info.size + size;
+        info = {size, fs::file_time_type::clock::now()};
+        counters.inserts++;
+        full = totalSize > maxSize;
+    }
+    if (full)
+        trim();
+}
+
+void CompressCache::trim()
+{
+    std::lock_guard lock{m};
+    if (totalSize <= maxSize)
+        return;
+
+    // Evict down to 90% so we do not trim again on the next insert
+    std::vector<std::pair<fs::file_time_type, std::string>> byAge;
+    byAge.reserve(files.size());
+    for (auto const& [name, info] : files)
+        byAge.emplace_back(info.used, name);
+    std::sort(byAge.begin(), byAge.end());
+
+    const uint64_t target = maxSize / 10 * 9;
+    for (auto const& [used, name] : byAge) {
+        if (totalSize <= target)
+            break;
+        std::error_code ec;
+        fs::remove(dir / name, ec);
+        totalSize -= files[name].size;
+        files.erase(name);
+        counters.evictions++;
+    }
+}
+
+CompressCache::Stats CompressCache::stats()
+{
+    std::lock_guard lock{m};
+    counters.cacheSize = totalSize;
+    return counters;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+
+// On disk cache of compressed file data, keyed by a hash of the contents and
+// the compression settings, so files that were compressed by an earlier
+// build (on any branch) can just be copied. Least recently used entries are
+// evicted when the cache grows past its size limit. Can be used from several
+// threads, and several processes can share a directory.
+class CompressCache
+{
+public:
+    struct Key
+    {
+        uint64_t hash[2];
+        uint64_t size;
+        uint32_t level;
+        uint32_t engine;
+    };
+
+    // XXH3-128 of the contents, fed in pieces while reading
+    class Hasher
+    {
+    public:
+        Hasher();
+        ~Hasher();
+        void update(const void* data, size_t size);
+        Key finish(uint64_t size, int level, int engine);
+
+    private:
+        struct State;
+        std::unique_ptr<State> state;
+    };
+
+    struct Entry
+    {
+        bool stored = false;
+        uint32_t crc = 0;
+        // SHA1 of the uncompressed data, for jar signing
+        uint8_t sha[20];
+        // Size of the compressed data; 0 if stored
+        uint64_t dataSize = 0;
+    };
+
+    struct Stats
+    {
+        int lookups = 0;
+        int hits = 0;
+        int inserts = 0;
+        int evictions = 0;
+        // Uncompressed bytes that did not need compressing
+        uint64_t savedBytes = 0;
+        uint64_t cacheSize = 0;
+    };
+
+    CompressCache(const fs::path& dir, uint64_t maxSize);
+
+    // Look up 'key'. On a hit the compressed data is read into 'data', which
+    // must hold 'capacity' bytes; entries that do not fit count as misses.
+    bool get(const Key& key, Entry& entry, uint8_t* data, size_t capacity);
+    // Add compressed data; 'data' is ignored for stored entries
+    void put(const Key& key, const Entry& entry, const uint8_t* data);
+    // Evict least recently used entries until the cache fits its limit
+    void trim();
+
+    Stats stats();
+
+private:
+    struct FileInfo
+    {
+        uint64_t size;
+        fs::file_time_type used;
+    };
+
+    std::string fileName(const Key& key) const;
+
+    fs::path dir;
+    uint64_t maxSize;
+    std::mutex m;
+    std::unordered_map<std::string, FileInfo> files;
+    uint64_t totalSize = 0;
+    Stats counters;
+};
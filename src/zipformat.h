@@ -144,6 +144,21 @@ struct PACK Unix2Extra
     int32_t GID;
 };
 
+// Extra field (in the central directory) of an entry deflated in independent
+// chunks: where each chunk after the first starts. Inflating can begin at
+// any of them without a window, so the chunks can be inflated in parallel.
+enum
+{
+    AccessIndex_ID = 0x465a
+};
+
+struct PACK AccessPoint
+{
+    // Relative to the start of the entry data
+    uint64_t compOffset;
+    uint64_t uncompOffset;
+};
+
 struct PACK Zip64Extra
 {
     int64_t uncompSize;
@@ -3,6 +3,7 @@
 #include "utils.h"
 #include "zipformat.h"
 #include <cassert>
+#include <cstring>
 #include <ctime>
 #include <sys/stat.h>
 
@@ -55,7 +56,7 @@ ZipStream::ZipStream(const std::string& zipName)
     f_.seek(4, SEEK_CUR);
     int64_t entryCount = f_.Read<uint16_t>();
     f_.seek(2, SEEK_CUR);
-    /* auto cdSize = */ f_.Read<uint32_t>();
+    int64_t cdSize = f_.Read<uint32_t>();
     int64_t cdOffset = f_.Read<uint32_t>();
     auto commentLen = f_.Read<uint16_t>();
     if (commentLen > 0) {
@@ -77,8 +78,11 @@ ZipStream::ZipStream(const std::string& zipName)
         auto eocd64 = f_.Read<EndOfCentralDir64>();
 
         cdOffset = eocd64.cdoffset;
+        cdSize = eocd64.cdsize;
         entryCount = eocd64.entries;
     }
+    cdOffset_ = cdOffset;
+    cdSize_ = cdSize;
 
     entries_.reserve(entryCount);
 
@@ -90,13 +94,32 @@ ZipStream::ZipStream(const std::string& zipName)
         fileName[rc] = 0;
         f_.seek(cd.nameLen - rc, SEEK_CUR);
         int64_t offset = cd.offset;
+        uint64_t compSize = cd.compSize;
+        uint64_t uncompSize = cd.uncompSize;
         int exLen = cd.exLen;
         Extra extra{};
+        std::vector<AccessPoint> accessPoints;
         while (exLen > 0) {
             f_.Read((uint8_t*)&extra, 4);
             f_.Read(extra.data, extra.size);
             if (extra.id == 0x01) {
-                offset = extra.zip64.offset;
+                // Only the values that overflowed are stored, in order
+                auto const* ptr = extra.data;
+                auto const* end = extra.data + extra.size;
+                auto read64 = [&](auto& value) {
+                    if (ptr + 8 > end)
+                        return;
+                    int64_t v;
+                    memcpy(&v, ptr, 8);
+                    value = v;
+                    ptr += 8;
+                };
+                if (cd.uncompSize == 0xffffffff)
+                    read64(uncompSize);
+                if (cd.compSize == 0xffffffff)
+                    read64(compSize);
+                if (cd.offset == 0xffffffff)
+                    read64(offset);
             } else if (extra.id == 0x7875) {
                 auto const* ptr = &extra.data[1];
                 uint32_t const uid = decodeInt(&ptr);
@@ -104,6 +127,10 @@ ZipStream::ZipStream(const std::string& zipName)
                 printf("UID %x GID %x\n", uid, gid);
             } else if (extra.id == 0x5455) {
                 // TODO: Read timestamps
+            } else if (extra.id == AccessIndex_ID) {
+                accessPoints.resize(extra.size / sizeof(AccessPoint));
+                memcpy(accessPoints.data(), extra.data,
+                       accessPoints.size() * sizeof(AccessPoint));
             } else
                 printf("**Warning: Ignoring extra block %04x\n", extra.id);
 
@@ -115,6 +142,12 @@ ZipStream::ZipStream(const std::string& zipName)
                                ? // Some archives have broken attributes
                                0
                                : cd.attr1 >> 16;
-        entries_.emplace_back(fileName, offset, flags);
+        auto& entry = entries_.emplace_back(fileName, offset, flags);
+        entry.compSize = compSize;
+        entry.uncompSize = uncompSize;
+        entry.crc = cd.crc;
+        entry.method = cd.method;
+        entry.dateTime = cd.dateTime;
+        entry.accessPoints = std::move(accessPoints);
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "file.h"
+#include "zipformat.h"
 
 #include <cstdio>
 #include <memory>
@@ -19,6 +20,12 @@ public:
         std::string name;
         int64_t offset;
         uint16_t flags;
+        uint64_t compSize = 0;
+        uint64_t uncompSize = 0;
+        uint32_t crc = 0;
+        uint16_t method = 0;
+        uint32_t dateTime = 0;
+        std::vector<AccessPoint> accessPoints;
         void* data;
     };
 
@@ -41,7 +48,13 @@ public:
 
     File dupFile() const { return File(zipName_, File::Mode::READ); }
 
+    // Where the central directory is, and its size in bytes
+    int64_t centralOffset() const { return cdOffset_; }
+    int64_t centralSize() const { return cdSize_; }
+
 private:
     std::string zipName_;
     File f_;
+    int64_t cdOffset_ = 0;
+    int64_t cdSize_ = 0;
 };